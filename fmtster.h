@@ -24,15 +24,63 @@
 #define FMTSTER_VERSION 000600 // 0.6.0
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
 #include <fmt/core.h>
 #include <fmt/format.h>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
 #include <regex>
+#include <shared_mutex>
+#include <streambuf>
 #include <string>
+#include <system_error>
+#include <thread>
 #include <type_traits>
 #include <utility>
 #include <vector>
 
+// file descriptor sinks (fmtster::FdSink) are available where POSIX is
+#if __has_include(<unistd.h>)
+#include <unistd.h>
+#endif // __has_include(<unistd.h>)
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif // __has_include(<sys/mman.h>)
+#if __has_include(<sys/uio.h>)
+#include <sys/uio.h>
+#endif // __has_include(<sys/uio.h>)
+
+// serialization into memory resources (std::pmr::string) is available where
+// the standard library has them
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#endif // __has_include(<memory_resource>)
+
+// SSE2/AVX2 kernels (selected at run time) are used where available, unless
+// FMTSTER_SIMD is defined as 0
+#ifndef FMTSTER_SIMD
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && defined(__GNUC__)
+#define FMTSTER_SIMD 1
+#else
+#define FMTSTER_SIMD 0
+#endif
+#endif // FMTSTER_SIMD
+
+#if FMTSTER_SIMD
+#include <immintrin.h>
+#endif // FMTSTER_SIMD
+
 namespace fmtster
 {
 using std::find;
@@ -55,7 +103,7 @@ using std::vector;
 template<typename... Args>
 string F(std::string_view fmt, const Args&... args)
 {
-    return fmt::format(fmt, args...);
+    return fmt::format(fmt::runtime(fmt), args...);
 }
 
 //
@@ -83,10 +131,21 @@ enum JSS
 }; // enum JSS
 
 //
-// Definition of XXXStyle structures, reused multiple times below
+// Enumeration of the handling of chars above ASCII in JSON strings, for use in
+// fmtster::JSONStyle::utf8
 //
-#if false // @@@ TODO: Implement members commented out below
+enum JSU
+{
+    ESCAPE_ALL      = 0x0,  // every byte above ASCII is escaped as \u00XX
+    UTF8_REPLACE    = 0x1,  // valid UTF-8 passes through, and each invalid
+                            // sequence is replaced by U+FFFD
+    UTF8_ESCAPE     = 0x2   // valid UTF-8 passes through, and each byte of an
+                            // invalid sequence is escaped as \u00XX
+}; // enum JSU
 
+//
+// Definition of XXXStyle structures, reused multiple times below
+//
 #define JSONSTYLESTRUCT                                                        \
     {                                                                          \
         /* note that these two booleans can never both be false, so they  */   \
@@ -98,7 +157,11 @@ enum JSS
         bool hardTab : 1;                                                      \
         unsigned int tabCount : 4;                                             \
                                                                                \
+        unsigned int utf8 : 2;                                                 \
+                                                                               \
         /* [ <gap A> value, <gap B> value <gap C> ] */                         \
+        /* (newline gaps are indented to the depth of the brackets, before */  \
+        /* any extra spaces or tabs)                                       */  \
         unsigned int gapA : 4;                                                 \
         unsigned int gapB : 4;                                                 \
         unsigned int gapC : 4;                                                 \
@@ -112,28 +175,30 @@ enum JSS
         unsigned int gap6 : 4;                                                 \
         unsigned int gap7 : 4;                                                 \
                                                                                \
+        /* [ <empty array> ] and { <empty object> } (BLANK, SPACE or SPACEx2) */ \
         unsigned int emptyArray : 2;                                           \
         unsigned int emptyObject : 2;                                          \
                                                                                \
+        /* arrays and objects of a single non-container value can be PACKED */ \
+        /* (e.g. [1]), on the SAMELINE (e.g. [ 1 ]) or in the SAMESTYLE as  */ \
+        /* any other (i.e. using the gaps above)                           */  \
         unsigned int singleLineArray : 2;                                      \
         unsigned int singleLineObject : 2;                                     \
     }
 
-#else
-
-// @@@ TODO: See above (only these are currently implemented)
-#define JSONSTYLESTRUCT                                                        \
-    {                                                                          \
-        bool cr : 1;                                                           \
-        bool lf : 1;                                                           \
-        bool hardTab : 1;                                                      \
-        unsigned int tabCount : 4;                                             \
-    }
-
-#endif // true
+// Applies FIELD() to the name of each JSONStyle member
+#define fmtster_JSONSTYLEFIELDS(FIELD)                                         \
+    FIELD(cr) FIELD(lf) FIELD(hardTab) FIELD(tabCount) FIELD(utf8)             \
+    FIELD(gapA) FIELD(gapB) FIELD(gapC)                                        \
+    FIELD(gap1) FIELD(gap2) FIELD(gap3) FIELD(gap4) FIELD(gap5) FIELD(gap6)    \
+    FIELD(gap7)                                                                \
+    FIELD(emptyArray) FIELD(emptyObject)                                       \
+    FIELD(singleLineArray) FIELD(singleLineObject)
 
-// forward declaration
+// forward declarations
 struct Base;
+template<typename T>
+class Cached;
 
 namespace internal
 {
@@ -225,6 +290,8 @@ fmtster_MAKEHASTYPE(container_type);
 fmtster_MAKEHASFN(begin);
 fmtster_MAKEHASFN(end);
 fmtster_MAKEHASFN(at);
+fmtster_MAKEHASFN(size);
+fmtster_MAKEHASFN(reference);
 
 // functional equivalent for fmtster_MAKEHASFN(operator[])
 template<typename T, typename U = void>
@@ -248,11 +315,16 @@ inline constexpr bool is_string_v = is_string<T>::value;
 
 fmtster_MAKEIS(container,
                (conjunction_v<has_const_iterator<T>, has_begin<T>, has_end<T> >));
-// overriding specialization for std::string, which is not considered a container by fmtster
+// overriding specializations for std::string & std::string_view, which are not
+// considered containers by fmtster
 template<>
 struct is_container<string>
   : false_type
 {};
+template<>
+struct is_container<std::string_view>
+  : false_type
+{};
 
 fmtster_MAKEIS(mappish, (conjunction_v<has_key_type<T>,
                                        has_mapped_type<T>,
@@ -287,6 +359,40 @@ struct is_tuple<std::tuple<Ts...> >
 template<typename... Ts>
 inline constexpr bool is_tuple_v = is_tuple<Ts...>::value;
 
+// specific detection for fmtster::Cached<>
+template<typename T>
+struct is_cached
+  : false_type
+{};
+template<typename T>
+struct is_cached<Cached<T> >
+  : true_type
+{};
+template<typename... Ts>
+inline constexpr bool is_cached_v = is_cached<Ts...>::value;
+
+// std::tuple<> of std::pair<>s with string keys (the record pattern), whose
+// containers can be written in columns (see the 'c' and 't' per call parms)
+template<typename T>
+struct is_record_field
+  : false_type
+{};
+template<typename K, typename V>
+struct is_record_field<std::pair<K, V> >
+  : std::is_convertible<const K&, std::string_view>
+{};
+template<typename T>
+struct is_record
+  : false_type
+{};
+template<typename... Ts>
+struct is_record<std::tuple<Ts...> >
+  : std::bool_constant<(sizeof...(Ts) > 0) &&
+                       (is_record_field<simplify_type<Ts> >::value && ...)>
+{};
+template<typename... Ts>
+inline constexpr bool is_record_v = is_record<Ts...>::value;
+
 fmtster_MAKEIS(fmtsterable,
                (std::is_base_of_v<fmtster::Base, fmt::formatter<simplify_type<T> > >));
 fmtster_MAKEIS(braceable, (disjunction_v<is_mappish<T>,
@@ -347,28 +453,59 @@ constexpr internal::ForwardJSONStyle DEFAULTJSONCONFIG =
         .hardTab = false,
         .tabCount = 2,
 
-#if false // @@@ disable members that are not implemented
+        .utf8 = JSU::ESCAPE_ALL,
 
         .gapA = JSS::NEWLINE_TAB,
-        .gapB = JSS::SPACE,
-        .gapC = JSS::SPACE,
+        .gapB = JSS::NEWLINE_TAB,
+        .gapC = JSS::NEWLINE,
 
         .gap1 = JSS::NEWLINE_TAB,
-        .gap2 = JSS::BLANK,
+        .gap2 = JSS::SPACE,
         .gap3 = JSS::SPACE,
         .gap4 = JSS::NEWLINE_TAB,
-        .gap5 = JSS::BLANK,
+        .gap5 = JSS::SPACE,
         .gap6 = JSS::SPACE,
         .gap7 = JSS::NEWLINE,
 
         .emptyArray = JSS::SPACE,
         .emptyObject = JSS::SPACE,
 
-        .singleLineArray = JSS::SAMELINE,
-        .singleLineObject = JSS::SAMELINE
+        .singleLineArray = JSS::SAMESTYLE,
+        .singleLineObject = JSS::SAMESTYLE
+    }
+};
+
+//
+// Minified JSON, without any whitespace
+//
+constexpr internal::ForwardJSONStyle PACKEDJSONCONFIG =
+{
+    {
+        .cr = DEFAULTJSONCONFIG.cr,
+        .lf = DEFAULTJSONCONFIG.lf,
+
+        .hardTab = false,
+        .tabCount = 0,
+
+        .utf8 = JSU::ESCAPE_ALL,
+
+        .gapA = JSS::BLANK,
+        .gapB = JSS::BLANK,
+        .gapC = JSS::BLANK,
 
-#endif // false
+        .gap1 = JSS::BLANK,
+        .gap2 = JSS::BLANK,
+        .gap3 = JSS::BLANK,
+        .gap4 = JSS::BLANK,
+        .gap5 = JSS::BLANK,
+        .gap6 = JSS::BLANK,
+        .gap7 = JSS::BLANK,
 
+        .emptyArray = JSS::BLANK,
+        .emptyObject = JSS::BLANK,
+
+        .singleLineArray = JSS::PACKED,
+        .singleLineObject = JSS::PACKED
     }
 };
 
@@ -395,6 +532,312 @@ public:
 namespace internal
 {
 
+//
+// Compile-time conversions between style values and their fields (the unions
+// above cannot be read through their inactive member in a constant
+// expression, so the value is bit cast to the fields instead, and the fields
+// are shifted into place by the positions found by decoding single bits)
+//
+template<size_t PADDING = sizeof(VALUE_T) - sizeof(MeasureJSONStyle)>
+struct PaddedJSONStyle
+{
+    MeasureJSONStyle fields;
+    char padding[PADDING];
+};
+template<>
+struct PaddedJSONStyle<0>
+{
+    MeasureJSONStyle fields;
+};
+
+constexpr MeasureJSONStyle DecodeJSONStyle(VALUE_T value)
+{
+    return __builtin_bit_cast(PaddedJSONStyle<>, value).fields;
+}
+
+template<typename GET>
+constexpr VALUE_T EncodeJSONStyleField(const MeasureJSONStyle& fields, GET get)
+{
+    for (size_t shift = 0; shift < sizeof(VALUE_T) * 8; shift++)
+    {
+        if (get(DecodeJSONStyle(VALUE_T(1) << shift)))
+            return VALUE_T(get(fields)) << shift;
+    }
+    return 0;
+}
+
+constexpr VALUE_T EncodeJSONStyle(const MeasureJSONStyle& fields)
+{
+#define fmtster_ENCODEFIELD(NAME)                                              \
+    | EncodeJSONStyleField(fields, [](const MeasureJSONStyle& f) { return f.NAME; })
+
+    return 0 fmtster_JSONSTYLEFIELDS(fmtster_ENCODEFIELD);
+
+#undef fmtster_ENCODEFIELD
+}
+
+} // namespace internal
+
+//
+// Fields of a style configuration, which can be modified in a constant
+// expression before getting their value with JSONStyleValue()
+//
+using JSONStyleFields = internal::MeasureJSONStyle;
+
+template<typename S,
+         typename = enable_if_t<std::is_same_v<S, internal::ForwardJSONStyle> > >
+constexpr JSONStyleFields GetJSONStyleFields(const S& style)
+{
+    JSONStyleFields fields = {};
+
+#define fmtster_COPYFIELD(NAME) fields.NAME = style.NAME;
+    fmtster_JSONSTYLEFIELDS(fmtster_COPYFIELD)
+#undef fmtster_COPYFIELD
+
+    return fields;
+}
+
+//
+// Style value of the fields, for use as a constant (e.g. as the template
+// argument of fmtster::format<>()):
+//     constexpr auto COMPACT = []()
+//     {
+//         auto fields = fmtster::GetJSONStyleFields(fmtster::DEFAULTJSONCONFIG);
+//         fields.tabCount = 1;
+//         return fmtster::JSONStyleValue(fields);
+//     }();
+//
+constexpr internal::VALUE_T JSONStyleValue(const JSONStyleFields& fields)
+{
+    return internal::EncodeJSONStyle(fields);
+}
+// (e.g. fmtster::JSONStyleValue(fmtster::DEFAULTJSONCONFIG))
+template<typename S,
+         typename = enable_if_t<std::is_same_v<S, internal::ForwardJSONStyle> > >
+constexpr internal::VALUE_T JSONStyleValue(const S& style)
+{
+    return internal::EncodeJSONStyle(GetJSONStyleFields(style));
+}
+
+namespace internal
+{
+
+//
+// Helpers to write directly to an output iterator
+//
+template<typename OutputIt>
+OutputIt put(OutputIt out, char c)
+{
+    *out++ = c;
+    return out;
+}
+template<typename OutputIt>
+OutputIt put(OutputIt out, std::string_view sv)
+{
+    return std::copy(sv.begin(), sv.end(), out);
+}
+
+//
+// Output iterator which only counts the chars written through it, for
+// measuring a serialization without writing it (see
+// fmtster::serialized_size())
+//
+class CountingIterator
+{
+    size_t mCount = 0;
+
+public:
+    using iterator_category = std::output_iterator_tag;
+    using value_type = void;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = void;
+
+    CountingIterator& operator*() { return *this; }
+    CountingIterator& operator++() { return *this; }
+    CountingIterator& operator++(int) { return *this; }
+    CountingIterator& operator=(char) { mCount++; return *this; }
+
+    size_t count() const { return mCount; }
+
+    void advance(size_t size) { mCount += size; }
+};
+
+// (whole strings are counted at once)
+inline CountingIterator put(CountingIterator out, std::string_view sv)
+{
+    out.advance(sv.size());
+    return out;
+}
+
+//
+// Output iterator which appends to a fmtster::BufferedSink<> (or to a Budget)
+//
+template<typename SINK>
+class SinkIterator
+{
+    SINK* mpSink;
+
+public:
+    using iterator_category = std::output_iterator_tag;
+    using value_type = void;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = void;
+
+    explicit SinkIterator(SINK& sink)
+      : mpSink(&sink)
+    {}
+
+    SinkIterator& operator*() { return *this; }
+    SinkIterator& operator++() { return *this; }
+    SinkIterator& operator++(int) { return *this; }
+    SinkIterator& operator=(char c) { mpSink->push_back(c); return *this; }
+
+    SINK& sink() const { return *mpSink; }
+};
+
+// (whole strings are copied into the buffer at once)
+template<typename SINK>
+SinkIterator<SINK> put(SinkIterator<SINK> out, std::string_view sv)
+{
+    out.sink().append(sv.data(), sv.size());
+    return out;
+}
+
+//
+// Whether the output references the chars written by putInPlace(), instead of
+// copying them (see fmtster::GatherSink)
+//
+template<typename OutputIt>
+struct references_in_place
+  : false_type
+{};
+
+template<typename SINK>
+struct references_in_place<SinkIterator<SINK> >
+  : std::bool_constant<has_reference_v<SINK&, std::string_view> >
+{};
+
+//
+// Write chars of the value being serialized (which stay valid at least as long
+// as the output is used)
+//
+template<typename OutputIt>
+OutputIt putInPlace(OutputIt out, std::string_view sv)
+{
+    if constexpr (references_in_place<OutputIt>::value)
+    {
+        out.sink().reference(sv);
+        return out;
+    }
+    else
+    {
+        return put(out, sv);
+    }
+}
+
+//
+// Output buffer of fmtster::format_to_n(), which drops the chars beyond its
+// limit and is then exhausted, so the serializer stops its traversal. When the
+// output is to be closed, the end of each complete element is committed along
+// with the brackets open at that point, as long as there is room left to close
+// them.
+//
+class Budget
+{
+public:
+    // open bracket/brace, with the size of its closing gap and bracket/brace
+    struct Level
+    {
+        bool mBraceable;
+        size_t mIndent;
+        bool mEmpty;
+        bool mSingleLine;
+        size_t mCloseSize;
+    };
+
+    const size_t mLimit;
+    const bool mClose;
+
+    string mBuffer;
+    bool mExhausted = false;
+
+    // elements which were never reached (see fmtster::format_to_n())
+    size_t mOmitted = 0;
+
+    std::vector<Level> mLevels;
+    size_t mCloseSize = 0;
+
+    size_t mCommitSize = 0;
+    std::vector<Level> mCommitLevels;
+
+    // (the buffer grows past this as it is written, since the limit may be
+    // far beyond the size of the output)
+    static constexpr size_t INITIAL_RESERVE = 4096;
+
+    Budget(size_t limit, bool close)
+      : mLimit(limit),
+        mClose(close)
+    {
+        mBuffer.reserve(std::min(limit, INITIAL_RESERVE));
+    }
+
+    size_t room() const
+    {
+        return mLimit - mBuffer.size();
+    }
+
+    void push_back(char c)
+    {
+        if (mBuffer.size() < mLimit)
+            mBuffer.push_back(c);
+        else
+            mExhausted = true;
+    }
+
+    void append(const char* p, size_t size)
+    {
+        if (size > room())
+        {
+            size = room();
+            mExhausted = true;
+        }
+        mBuffer.append(p, size);
+    }
+
+    void open(const Level& level)
+    {
+        mLevels.push_back(level);
+        mCloseSize += level.mCloseSize;
+        commit();
+    }
+
+    void close()
+    {
+        mCloseSize -= mLevels.back().mCloseSize;
+        mLevels.pop_back();
+    }
+
+    // returns whether there is budget left to continue
+    bool commit()
+    {
+        if (mClose && !mExhausted)
+        {
+            if (mBuffer.size() + mCloseSize <= mLimit)
+            {
+                mCommitSize = mBuffer.size();
+                mCommitLevels = mLevels;
+            }
+            else
+            {
+                mExhausted = true;
+            }
+        }
+        return !mExhausted;
+    }
+}; // class Budget
+
 //
 // Base struct used by all serialization format style helpers
 //
@@ -408,152 +851,1148 @@ struct StyleHelper
     } mStyle;
 
     //
-    // Common expanded strings
+    // Common expanded strings (refer to the interned, immutable expansions of
+    // the style)
     //
-    string mNewline;
-    string mTab;
+    std::string_view mNewline;
+    std::string_view mTab;
 
     StyleHelper(VALUE_T value)
       : mStyle{value}
     {}
 
-    // Needed to enable polymorphism
-    virtual ~StyleHelper() = default;
-
     //
     // Functions to convert string types to a desired numeric type
     //
     template<typename T>
-    T toValue(const char* sz, const string& throwArg = "")
+    T toValue(std::string_view sv, std::string_view throwArg = {}) const
     {
         T val = 0;
 
-        if (sz)
+        for (const char c : sv)
         {
-            do
+            if ((c > '9') || (c < '0'))
             {
-                const char c = *sz;
-                if ((c > '9') || (c < '0'))
-                {
-                    if (throwArg.empty())
-                    {
-                        val = 0;
-                        break;
-                    }
-                    else
-                    {
-                        throw fmt::format_error(F("fmtster: unsupported {} argument: \"{}\"",
-                                                  throwArg,
-                                                  sz));
-                    }
-                }
-                val = (val * 10) + (c - '0');
-            } while (*(++sz));
+                if (throwArg.empty())
+                    return 0;
+
+                throw fmt::format_error(F("fmtster: unsupported {} argument: \"{}\"",
+                                          throwArg,
+                                          sv));
+            }
+            val = (val * 10) + (c - '0');
         }
 
+        if (sv.empty() && !throwArg.empty())
+            throw fmt::format_error(F("fmtster: unsupported {} argument: \"\"",
+                                      throwArg));
+
         return val;
     }
-    template<typename T>
-    T toValue(const string& str)
-    {
-        return toValue<T>(str.c_str());
-    }
 
     //
     // Functions to convert input types to a format index
     //
-    int formatToValue(__int128_t i)
+    int formatToValue(__int128_t i) const
     {
         if (i != 0)
             throw fmt::format_error(F("fmtster: unsupported format argument value: {}", i));
         return i;
     }
     template<typename T>
-    int formatToValue(T i)
+    int formatToValue(T i) const
     {
         return formatToValue((__int128_t)i);
     }
-    int formatToValue(const char* const sz)
-    {
-        int format = -1;
-        if (sz)
-        {
-            const auto c0 = *sz;
-            if ((c0 == 'j') || (c0 == 'J'))
-            {
-                format = 0;
-            }
-            else
-            {
-                format = toValue<int>(sz, "format");
-            }
-        }
-        return formatToValue(format);
-    }
-    int formatToValue(const string& str)
+    int formatToValue(std::string_view sv) const
     {
-        return formatToValue(str.c_str());
+        const auto c0 = sv.empty() ? '\0' : sv.front();
+        if ((c0 == 'j') || (c0 == 'J'))
+            return 0;
+        return formatToValue(toValue<int>(sv, "format"));
     }
-    int formatToValue(const fmt::basic_string_view<char>& str)
+    int formatToValue(const char* const sz) const
     {
-        return formatToValue(str.data());
+        return sz ? formatToValue(std::string_view(sz)) : formatToValue(-1);
     }
-
-    virtual void updateExpansions()
+    int formatToValue(const fmt::basic_string_view<char>& str) const
     {
-        throw std::bad_function_call();
+        return formatToValue(std::string_view(str.data(), str.size()));
     }
 }; // StyleHelper
 
 //
-// Behind-the-scenes workhorse based on JSONStyle
+// Expansion of a single JSONStyle gap (see JSS). When the newline, the indents
+// and the extra spaces/tabs are all made of the same char, the text holds the
+// newline, MAX_INDENT indents and the extra, so the whole gap for any depth is
+// a prefix of it. Otherwise the text only holds the extra, and the newline and
+// indent are written separately.
 //
-
-class JSONStyleHelper
-  : public StyleHelper
+struct JSONGap
 {
-protected:
-    VALUE_T mLastStyleValue;
-
-#if false // @@@ TODO
+    bool mNewline;
+    bool mContiguous;
+    std::string_view mExtra;
+    std::string_view mText;
+};
 
-    string mArrayGap[3];
-    string mObjectGap[7];
-    string mEmptyArray;
-    string mEmptyObject;
+// number of spaces or tabs after the (optional) newline of a gap
+constexpr size_t JSONGapExtraCount(unsigned int bfv)
+{
+    return ((bfv & 3) == 3) ? 2 : (((bfv & 3) == 2) ? 1 : 0);
+}
 
-#endif // false
+constexpr bool JSONGapContiguous(unsigned int bfv, std::string_view tab)
+{
+    return (bfv & 8) &&
+           (!JSONGapExtraCount(bfv) || tab.empty() || (bfv & 4) || (tab.front() == ' '));
+}
 
-    string expand(unsigned int bfv)
-    {
-        using namespace std::string_literals;
+constexpr size_t JSONGapExtraSize(unsigned int bfv, std::string_view tab)
+{
+    return JSONGapExtraCount(bfv) * ((bfv & 4) ? tab.size() : 1);
+}
 
-        string e;
-        if (bfv & 8)
-            e += mNewline;
-        if ((bfv & 3) == 3)
-            e += (bfv & 4) ? mTab + mTab : "  "s;
-        else if ((bfv & 3) == 2)
-            e += (bfv & 4) ? mTab : " "s;
-        return e;
-    } // expand()
+constexpr size_t JSONGapTextSize(unsigned int bfv,
+                                 std::string_view newline,
+                                 std::string_view tab,
+                                 size_t maxIndent)
+{
+    return JSONGapContiguous(bfv, tab)
+           ? newline.size() + (maxIndent * tab.size()) + JSONGapExtraSize(bfv, tab)
+           : JSONGapExtraSize(bfv, tab);
+}
 
-public:
-    JSONStyleHelper(VALUE_T val = DEFAULTJSONCONFIG.value)
-      : StyleHelper(val ? val : DEFAULTJSONCONFIG.value),
-        mLastStyleValue(0)
+// buf must hold JSONGapTextSize() chars
+constexpr void FillJSONGapText(char* buf,
+                               unsigned int bfv,
+                               std::string_view newline,
+                               std::string_view tab,
+                               size_t maxIndent)
+{
+    if (JSONGapContiguous(bfv, tab))
     {
-        updateExpansions();
+        for (const auto c : newline)
+            *buf++ = c;
+        for (size_t i = 0; i < maxIndent; i++)
+        {
+            for (const auto c : tab)
+                *buf++ = c;
+        }
     }
-
-    JSONStyleHelper operator=(VALUE_T value)
+    for (size_t i = 0; i < JSONGapExtraCount(bfv); i++)
     {
-        mStyle.value = value;
-        updateExpansions();
-        return *this;
+        if (bfv & 4)
+        {
+            for (const auto c : tab)
+                *buf++ = c;
+        }
+        else
+        {
+            *buf++ = ' ';
+        }
     }
+}
 
-    JSONStyleHelper operator=(const JSONStyle& style)
+// text is the (filled) JSONGapTextSize() chars
+constexpr JSONGap MakeJSONGap(std::string_view text,
+                              unsigned int bfv,
+                              std::string_view tab)
+{
+    const auto extraSize = JSONGapExtraSize(bfv, tab);
+    return { (bfv & 8) != 0,
+             JSONGapContiguous(bfv, tab),
+             text.substr(text.size() - extraSize),
+             text };
+}
+
+//
+// Immutable expansions of a JSONStyle, which are computed once per style value
+// and then shared (read-only) by all formatters using that style
+//
+struct JSONStyleExpansion
+{
+    // Indent strings for depths up to this are precomputed (deeper indents are
+    // written in multiple pieces)
+    static constexpr size_t MAX_INDENT = 32;
+
+    const VALUE_T mValue;
+
+    string mNewline;
+    string mTab;
+
+    // Handling of chars above ASCII in strings (see JSU)
+    unsigned int mUtf8;
+
+    // Gaps A - C, gaps 1 - 7, and the empty array/object gaps
+    std::array<JSONGap, 3> mArrayGap;
+    std::array<JSONGap, 7> mObjectGap;
+    std::string_view mEmptyArray;
+    std::string_view mEmptyObject;
+
+    // Single line options (see JSS)
+    unsigned int mSingleLineArray;
+    unsigned int mSingleLineObject;
+
+private:
+    // MAX_INDENT tabs, so each depth's indent is a prefix of it
+    string mIndents;
+
+    // Text of each gap above (in that order)
+    string mGapText[12];
+
+    JSONGap expand(unsigned int bfv, size_t index)
+    {
+        auto& text = mGapText[index];
+        text.resize(JSONGapTextSize(bfv, mNewline, mTab, MAX_INDENT));
+        FillJSONGapText(&text[0], bfv, mNewline, mTab, MAX_INDENT);
+        return MakeJSONGap(text, bfv, mTab);
+    } // expand()
+
+public:
+    explicit JSONStyleExpansion(VALUE_T value)
+      : mValue(value),
+        mUtf8(JSONStyle(value).utf8),
+        mSingleLineArray(JSONStyle(value).singleLineArray),
+        mSingleLineObject(JSONStyle(value).singleLineObject)
+    {
+        const JSONStyle style(value);
+
+        if (style.cr)
+            mNewline = "\r";
+        if (style.lf)
+            mNewline += "\n";
+
+        mTab = style.hardTab
+               ? string(style.tabCount, '\t')
+               : string(style.tabCount, ' ');
+
+        mIndents.reserve(mTab.size() * MAX_INDENT);
+        for (auto i = MAX_INDENT; i; --i)
+            mIndents += mTab;
+
+        mArrayGap[0] = expand(style.gapA, 0);
+        mArrayGap[1] = expand(style.gapB, 1);
+        mArrayGap[2] = expand(style.gapC, 2);
+
+        mObjectGap[0] = expand(style.gap1, 3);
+        mObjectGap[1] = expand(style.gap2, 4);
+        mObjectGap[2] = expand(style.gap3, 5);
+        mObjectGap[3] = expand(style.gap4, 6);
+        mObjectGap[4] = expand(style.gap5, 7);
+        mObjectGap[5] = expand(style.gap6, 8);
+        mObjectGap[6] = expand(style.gap7, 9);
+
+        // (only the extra spaces are used)
+        mEmptyArray = expand(style.emptyArray, 10).mExtra;
+        mEmptyObject = expand(style.emptyObject, 11).mExtra;
+    }
+
+    JSONStyleExpansion(const JSONStyleExpansion&) = delete;
+    JSONStyleExpansion& operator=(const JSONStyleExpansion&) = delete;
+
+    // indent for the specified depth (which must not exceed MAX_INDENT)
+    std::string_view indent(size_t depth) const
+    {
+        return std::string_view(mIndents.data(), depth * mTab.size());
+    }
+
+    //
+    // Look up the (process-wide) interned expansions for the style value,
+    // creating them on first use. Entries are never removed, so the reference
+    // remains valid for the life of the process.
+    //
+    static const JSONStyleExpansion& Get(VALUE_T value)
+    {
+        // most recently used entries of this thread, to avoid locking
+        constexpr size_t RECENT_COUNT = 4;
+        thread_local const JSONStyleExpansion* recent[RECENT_COUNT] = {};
+        thread_local size_t recentNext = 0;
+
+        for (const auto pRecent : recent)
+        {
+            if (pRecent && (pRecent->mValue == value))
+                return *pRecent;
+        }
+
+        static std::shared_mutex mutex;
+        static std::map<VALUE_T, std::unique_ptr<const JSONStyleExpansion> > cache;
+
+        const JSONStyleExpansion* pExpansion = nullptr;
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            const auto it = cache.find(value);
+            if (it != cache.end())
+                pExpansion = it->second.get();
+        }
+        if (!pExpansion)
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            auto& pEntry = cache[value];
+            if (!pEntry)
+                pEntry = std::make_unique<const JSONStyleExpansion>(value);
+            pExpansion = pEntry.get();
+        }
+
+        recent[recentNext] = pExpansion;
+        recentNext = (recentNext + 1) % RECENT_COUNT;
+
+        return *pExpansion;
+    } // Get()
+}; // struct JSONStyleExpansion
+
+//
+// Expansions of a style value known at compile time, as constants which can
+// be used by the serializer in place of JSONStyleExpansion (so the member
+// names match, although they are static)
+//
+template<VALUE_T STYLE>
+struct StaticJSONStyleExpansion
+{
+    static_assert(STYLE != 0, "fmtster: a static style must not be 0 (the default)");
+
+    static constexpr size_t MAX_INDENT = JSONStyleExpansion::MAX_INDENT;
+
+    static constexpr MeasureJSONStyle FIELDS = DecodeJSONStyle(STYLE);
+
+    static constexpr VALUE_T mValue = STYLE;
+
+    static constexpr std::string_view mNewline =
+        FIELDS.cr ? (FIELDS.lf ? "\r\n" : "\r") : (FIELDS.lf ? "\n" : "");
+
+    static constexpr unsigned int mUtf8 = FIELDS.utf8;
+
+private:
+    static constexpr size_t TAB_SIZE = FIELDS.tabCount;
+
+    // MAX_INDENT tabs, so each depth's indent is a prefix of it
+    static constexpr std::array<char, TAB_SIZE * MAX_INDENT + 1> INDENTS =
+        []()
+        {
+            std::array<char, TAB_SIZE * MAX_INDENT + 1> indents = {};
+            for (size_t i = 0; i < TAB_SIZE * MAX_INDENT; i++)
+                indents[i] = FIELDS.hardTab ? '\t' : ' ';
+            return indents;
+        }();
+
+public:
+    static constexpr std::string_view mTab = std::string_view(INDENTS.data(), TAB_SIZE);
+
+    static constexpr unsigned int mSingleLineArray = FIELDS.singleLineArray;
+    static constexpr unsigned int mSingleLineObject = FIELDS.singleLineObject;
+
+private:
+    // Gaps A - C, gaps 1 - 7, and the empty array/object gaps
+    static constexpr std::array<unsigned int, 12> GAP_FIELDS =
+    {
+        FIELDS.gapA, FIELDS.gapB, FIELDS.gapC,
+        FIELDS.gap1, FIELDS.gap2, FIELDS.gap3, FIELDS.gap4, FIELDS.gap5, FIELDS.gap6, FIELDS.gap7,
+        FIELDS.emptyArray, FIELDS.emptyObject
+    };
+
+    static constexpr size_t GAP_CAPACITY = 2 + ((MAX_INDENT + 2) * (TAB_SIZE ? TAB_SIZE : 1));
+
+    static constexpr std::array<std::array<char, GAP_CAPACITY>, 12> GAP_TEXTS =
+        []()
+        {
+            std::array<std::array<char, GAP_CAPACITY>, 12> texts = {};
+            for (size_t i = 0; i < texts.size(); i++)
+                FillJSONGapText(texts[i].data(), GAP_FIELDS[i], mNewline, mTab, MAX_INDENT);
+            return texts;
+        }();
+
+    static constexpr JSONGap GAPS[12] =
+    {
+#define fmtster_STATICGAP(I)                                                   \
+        MakeJSONGap(std::string_view(GAP_TEXTS[I].data(),                      \
+                                     JSONGapTextSize(GAP_FIELDS[I], mNewline, mTab, MAX_INDENT)), \
+                    GAP_FIELDS[I],                                             \
+                    mTab)
+
+        fmtster_STATICGAP(0), fmtster_STATICGAP(1), fmtster_STATICGAP(2),
+        fmtster_STATICGAP(3), fmtster_STATICGAP(4), fmtster_STATICGAP(5),
+        fmtster_STATICGAP(6), fmtster_STATICGAP(7), fmtster_STATICGAP(8),
+        fmtster_STATICGAP(9), fmtster_STATICGAP(10), fmtster_STATICGAP(11)
+
+#undef fmtster_STATICGAP
+    };
+
+public:
+    static constexpr std::array<JSONGap, 3> mArrayGap = { GAPS[0], GAPS[1], GAPS[2] };
+    static constexpr std::array<JSONGap, 7> mObjectGap =
+        { GAPS[3], GAPS[4], GAPS[5], GAPS[6], GAPS[7], GAPS[8], GAPS[9] };
+    static constexpr std::string_view mEmptyArray = GAPS[10].mExtra;
+    static constexpr std::string_view mEmptyObject = GAPS[11].mExtra;
+
+    // indent for the specified depth (which must not exceed MAX_INDENT)
+    static constexpr std::string_view indent(size_t depth)
+    {
+        return std::string_view(INDENTS.data(), depth * TAB_SIZE);
+    }
+}; // struct StaticJSONStyleExpansion
+
+//
+// Process-wide registry of styles by short name (see
+// fmtster::RegisterJSONStyle()), which allows a format string to refer to a
+// style as "@name" (e.g. "{:,,@compact}")
+//
+class NamedStyles
+{
+    mutable std::shared_mutex mMutex;
+    std::map<string, VALUE_T, std::less<> > mValues;
+
+public:
+    static NamedStyles& JSON()
+    {
+        static NamedStyles namedStyles;
+        return namedStyles;
+    }
+
+    void add(std::string_view name, VALUE_T value)
+    {
+        std::unique_lock<std::shared_mutex> lock(mMutex);
+        auto it = mValues.find(name);
+        if (it != mValues.end())
+            it->second = value;
+        else
+            mValues.emplace(name, value);
+    }
+
+    VALUE_T find(std::string_view name) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mMutex);
+        const auto it = mValues.find(name);
+        if (it == mValues.end())
+            throw fmt::format_error(F("fmtster: unknown style name: \"{}\"", name));
+        return it->second;
+    }
+}; // class NamedStyles
+
+//
+// JSON escape scanning kernels, each returning the offset of the first char in
+// the buffer which must be escaped (or the buffer length, if there are none):
+// control chars, '"', '\\', '/', DEL and (unless UTF8) all chars above ASCII
+//
+using JSONEscapeScan = size_t (*)(const char* p, size_t len);
+
+template<bool UTF8 = false>
+inline bool NeedsJSONEscape(char c)
+{
+    return ((unsigned char)c < 0x20) || (c == '\x7F') ||
+           (!UTF8 && ((unsigned char)c >= 0x80)) ||
+           (c == '"') || (c == '\\') || (c == '/');
+}
+
+template<bool UTF8>
+inline size_t ScanJSONEscapeScalarT(const char* p, size_t len)
+{
+    size_t i = 0;
+    while ((i < len) && !NeedsJSONEscape<UTF8>(p[i]))
+        i++;
+    return i;
+}
+
+inline size_t ScanJSONEscapeScalar(const char* p, size_t len)
+{
+    return ScanJSONEscapeScalarT<false>(p, len);
+}
+
+inline size_t ScanUTF8JSONEscapeScalar(const char* p, size_t len)
+{
+    return ScanJSONEscapeScalarT<true>(p, len);
+}
+
+#if FMTSTER_SIMD
+
+// Compares are signed, so "less than 0x20" also catches all chars >= 0x80,
+// unless UTF8, when the control chars are found with an unsigned minimum
+template<bool UTF8>
+inline size_t ScanJSONEscapeSSE2T(const char* p, size_t len)
+{
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i us = _mm_set1_epi8(0x1F);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i slash = _mm_set1_epi8('/');
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        const __m128i control = UTF8
+                                ? _mm_cmpeq_epi8(_mm_min_epu8(v, us), v)
+                                : _mm_cmplt_epi8(v, space);
+        const __m128i needs =
+            _mm_or_si128(_mm_or_si128(control,
+                                      _mm_cmpeq_epi8(v, del)),
+                         _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                                   _mm_cmpeq_epi8(v, backslash)),
+                                      _mm_cmpeq_epi8(v, slash)));
+        const unsigned int mask = _mm_movemask_epi8(needs);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + ScanJSONEscapeScalarT<UTF8>(p + i, len - i);
+}
+
+inline size_t ScanJSONEscapeSSE2(const char* p, size_t len)
+{
+    return ScanJSONEscapeSSE2T<false>(p, len);
+}
+
+inline size_t ScanUTF8JSONEscapeSSE2(const char* p, size_t len)
+{
+    return ScanJSONEscapeSSE2T<true>(p, len);
+}
+
+template<bool UTF8>
+__attribute__((target("avx2")))
+inline size_t ScanJSONEscapeAVX2T(const char* p, size_t len)
+{
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i us = _mm256_set1_epi8(0x1F);
+    const __m256i del = _mm256_set1_epi8(0x7F);
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i slash = _mm256_set1_epi8('/');
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        const __m256i control = UTF8
+                                ? _mm256_cmpeq_epi8(_mm256_min_epu8(v, us), v)
+                                : _mm256_cmpgt_epi8(space, v);
+        const __m256i needs =
+            _mm256_or_si256(_mm256_or_si256(control,
+                                            _mm256_cmpeq_epi8(v, del)),
+                            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                                            _mm256_cmpeq_epi8(v, backslash)),
+                                            _mm256_cmpeq_epi8(v, slash)));
+        const unsigned int mask = _mm256_movemask_epi8(needs);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + ScanJSONEscapeSSE2T<UTF8>(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+inline size_t ScanJSONEscapeAVX2(const char* p, size_t len)
+{
+    return ScanJSONEscapeAVX2T<false>(p, len);
+}
+
+__attribute__((target("avx2")))
+inline size_t ScanUTF8JSONEscapeAVX2(const char* p, size_t len)
+{
+    return ScanJSONEscapeAVX2T<true>(p, len);
+}
+
+#endif // FMTSTER_SIMD
+
+//
+// The best kernel supported by the CPU (selected once, on first use), either
+// escaping all chars above ASCII or passing them through for UTF-8 handling
+//
+inline JSONEscapeScan ActiveJSONEscapeScan(bool utf8 = false)
+{
+    static const std::array<JSONEscapeScan, 2> scans =
+        []() -> std::array<JSONEscapeScan, 2>
+        {
+#if FMTSTER_SIMD
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2"))
+                return { ScanJSONEscapeAVX2, ScanUTF8JSONEscapeAVX2 };
+            return { ScanJSONEscapeSSE2, ScanUTF8JSONEscapeSSE2 };
+#else
+            return { ScanJSONEscapeScalar, ScanUTF8JSONEscapeScalar };
+#endif // FMTSTER_SIMD
+        }();
+    return scans[utf8];
+}
+
+//
+// Length of the UTF-8 sequence at the start of the buffer (which must not be
+// empty), with valid set to whether it is well-formed (per table 3-7 of the
+// Unicode standard). An ill-formed sequence is its maximal subpart, so it is
+// always at least one byte long.
+//
+inline size_t UTF8Sequence(const char* p, size_t len, bool& valid)
+{
+    const auto b0 = (unsigned char)p[0];
+    valid = false;
+
+    size_t count;
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xBF;
+    if (b0 < 0x80)
+    {
+        valid = true;
+        return 1;
+    }
+    else if ((b0 >= 0xC2) && (b0 <= 0xDF))
+        count = 2;
+    else if (b0 == 0xE0)
+        count = 3, lo = 0xA0;
+    else if (b0 == 0xED)
+        count = 3, hi = 0x9F;
+    else if ((b0 >= 0xE1) && (b0 <= 0xEF))
+        count = 3;
+    else if (b0 == 0xF0)
+        count = 4, lo = 0x90;
+    else if (b0 == 0xF4)
+        count = 4, hi = 0x8F;
+    else if ((b0 >= 0xF1) && (b0 <= 0xF3))
+        count = 4;
+    else
+        return 1;
+
+    for (size_t i = 1; i < count; i++)
+    {
+        if (i >= len)
+            return i;
+        const auto b = (unsigned char)p[i];
+        if ((b < lo) || (b > hi))
+            return i;
+        lo = 0x80;
+        hi = 0xBF;
+    }
+
+    valid = true;
+    return count;
+} // UTF8Sequence()
+
+//
+// UTF-8 validation kernels, each returning whether the whole buffer is valid
+//
+using UTF8Validate = bool (*)(const char* p, size_t len);
+
+inline bool ValidateUTF8Scalar(const char* p, size_t len)
+{
+    size_t i = 0;
+    while (i < len)
+    {
+        if ((unsigned char)p[i] < 0x80)
+        {
+            i++;
+            continue;
+        }
+        bool valid;
+        i += UTF8Sequence(p + i, len - i, valid);
+        if (!valid)
+            return false;
+    }
+    return true;
+}
+
+#if FMTSTER_SIMD
+
+//
+// Validates 32 bytes at a time by classifying each byte pair with nibble
+// lookup tables (see Keiser & Lemire, "Validating UTF-8 In Less Than One
+// Instruction Per Byte"), skipping blocks which are all ASCII
+//
+__attribute__((target("avx2")))
+inline bool ValidateUTF8AVX2(const char* p, size_t len)
+{
+    constexpr uint8_t TOO_SHORT = 1 << 0;       // lead byte not followed by
+                                                // enough continuations
+    constexpr uint8_t TOO_LONG = 1 << 1;        // continuation without a lead
+    constexpr uint8_t OVERLONG_3 = 1 << 2;
+    constexpr uint8_t TOO_LARGE = 1 << 3;
+    constexpr uint8_t SURROGATE = 1 << 4;
+    constexpr uint8_t OVERLONG_2 = 1 << 5;
+    constexpr uint8_t TOO_LARGE_1000 = 1 << 6;
+    constexpr uint8_t OVERLONG_4 = 1 << 6;
+    constexpr uint8_t TWO_CONTS = 1 << 7;       // two continuations in a row
+    constexpr uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+    // indexed by the high nibble of the first byte of each pair
+    alignas(16) static constexpr uint8_t BYTE_1_HIGH[16] =
+    {
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+    };
+    // indexed by the low nibble of the first byte of each pair
+    alignas(16) static constexpr uint8_t BYTE_1_LOW[16] =
+    {
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        CARRY | OVERLONG_2,
+        CARRY,
+        CARRY,
+        CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000
+    };
+    // indexed by the high nibble of the second byte of each pair
+    alignas(16) static constexpr uint8_t BYTE_2_HIGH[16] =
+    {
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+    };
+    // a block ending within a sequence is incomplete
+    alignas(32) static constexpr uint8_t MAX_VALUE[32] =
+    {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1
+    };
+
+    const __m256i byte1High =
+        _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(BYTE_1_HIGH)));
+    const __m256i byte1Low =
+        _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(BYTE_1_LOW)));
+    const __m256i byte2High =
+        _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(BYTE_2_HIGH)));
+    const __m256i maxValue = _mm256_load_si256(reinterpret_cast<const __m256i*>(MAX_VALUE));
+    const __m256i lowNibble = _mm256_set1_epi8(0x0F);
+
+    __m256i error = _mm256_setzero_si256();
+    __m256i prevInput = _mm256_setzero_si256();
+    __m256i prevIncomplete = _mm256_setzero_si256();
+
+    // zero padding of the final partial block makes a truncated final
+    // sequence too short
+    alignas(32) char tail[32] = {};
+
+    for (size_t i = 0; i < len; i += 32)
+    {
+        const char* pBlock = p + i;
+        if (len - i < 32)
+        {
+            std::copy_n(pBlock, len - i, tail);
+            pBlock = tail;
+        }
+        const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pBlock));
+
+        if (!_mm256_movemask_epi8(input))
+        {
+            error = _mm256_or_si256(error, prevIncomplete);
+        }
+        else
+        {
+            // the previous 1, 2 and 3 bytes of each byte
+            const __m256i carried = _mm256_permute2x128_si256(prevInput, input, 0x21);
+            const __m256i prev1 = _mm256_alignr_epi8(input, carried, 16 - 1);
+            const __m256i prev2 = _mm256_alignr_epi8(input, carried, 16 - 2);
+            const __m256i prev3 = _mm256_alignr_epi8(input, carried, 16 - 3);
+
+            const __m256i special =
+                _mm256_and_si256(
+                    _mm256_and_si256(
+                        _mm256_shuffle_epi8(byte1High,
+                                            _mm256_and_si256(_mm256_srli_epi16(prev1, 4), lowNibble)),
+                        _mm256_shuffle_epi8(byte1Low, _mm256_and_si256(prev1, lowNibble))),
+                    _mm256_shuffle_epi8(byte2High,
+                                        _mm256_and_si256(_mm256_srli_epi16(input, 4), lowNibble)));
+
+            // third and fourth bytes of sequences must be continuations
+            const __m256i must23 =
+                _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80))),
+                                _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80))));
+            const __m256i must23High = _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80));
+
+            error = _mm256_or_si256(error, _mm256_xor_si256(must23High, special));
+            prevIncomplete = _mm256_subs_epu8(input, maxValue);
+        }
+        prevInput = input;
+    }
+    error = _mm256_or_si256(error, prevIncomplete);
+
+    return _mm256_testz_si256(error, error);
+} // ValidateUTF8AVX2()
+
+#endif // FMTSTER_SIMD
+
+//
+// The best UTF-8 validation kernel supported by the CPU (selected once, on
+// first use)
+//
+inline UTF8Validate ActiveUTF8Validate()
+{
+    static const UTF8Validate validate =
+        []() -> UTF8Validate
+        {
+#if FMTSTER_SIMD
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2"))
+                return ValidateUTF8AVX2;
+#endif // FMTSTER_SIMD
+            return ValidateUTF8Scalar;
+        }();
+    return validate;
+}
+
+//
+// Compile-time policy for each serialization format, used by the serializer
+// (the runtime format argument is resolved to one of these once per call, at
+// the top level)
+//
+struct JSONFormat
+{
+    static constexpr int INDEX = 0;
+
+    using Expansion = JSONStyleExpansion;
+
+    static constexpr char ARRAY_OPEN = '[';
+    static constexpr char ARRAY_CLOSE = ']';
+    static constexpr char OBJECT_OPEN = '{';
+    static constexpr char OBJECT_CLOSE = '}';
+    static constexpr char KEY_SEPARATOR = ':';
+    static constexpr char VALUE_SEPARATOR = ',';
+    static constexpr char QUOTE = '"';
+    static constexpr std::string_view NULL_VALUE = "null";
+
+    // Marker of the elements elided by the 'e' per call parm (the count is
+    // between these, and the marker is quoted)
+    static constexpr std::string_view ELISION_PREFIX = "... ";
+    static constexpr std::string_view ELISION_SUFFIX = " more";
+
+    // Members of the table of records written by the 't' per call parm
+    static constexpr std::string_view RECORD_KEYS = "keys";
+    static constexpr std::string_view RECORD_ROWS = "rows";
+
+    // Escaped output is gathered in chunks of this size before being written
+    static constexpr size_t ESCAPE_CHUNK = 256;
+
+    // Replacement for each invalid UTF-8 sequence (U+FFFD, encoded as UTF-8)
+    static constexpr std::string_view UTF8_REPLACEMENT = "\xEF\xBF\xBD";
+
+    //
+    // Escape a single char (which the scan found needs it) into the buffer,
+    // returning the number of chars written (at most 6)
+    //
+    static size_t escapeChar(char* buf, char c)
+    {
+        static constexpr char HEX[] = "0123456789ABCDEF";
+
+        buf[0] = '\\';
+        switch (c)
+        {
+        case '\b':   buf[1] = 'b'; return 2;
+        case '\f':   buf[1] = 'f'; return 2;
+        case '\n':   buf[1] = 'n'; return 2;
+        case '\r':   buf[1] = 'r'; return 2;
+        case '\t':   buf[1] = 't'; return 2;
+        case '\\':   buf[1] = '\\'; return 2;
+        case '\"':   buf[1] = '"'; return 2;
+        case '/':    buf[1] = '/'; return 2;
+        default:
+            buf[1] = 'u';
+            buf[2] = '0';
+            buf[3] = '0';
+            buf[4] = HEX[(unsigned char)c >> 4];
+            buf[5] = HEX[(unsigned char)c & 0xF];
+            return 6;
+        }
+    } // escapeChar()
+
+    //
+    // Fixed-size chunk in which short runs and escapes are gathered before
+    // being written to the output, while long runs are copied straight from
+    // the input, so no temporary proportional to the string is ever needed
+    //
+    template<typename OutputIt>
+    class EscapeChunk
+    {
+        OutputIt mOut;
+        char mBuf[ESCAPE_CHUNK];
+        size_t mUsed = 0;
+
+        void flush()
+        {
+            mOut = put(mOut, std::string_view(mBuf, mUsed));
+            mUsed = 0;
+        }
+
+    public:
+        explicit EscapeChunk(OutputIt out)
+          : mOut(out)
+        {}
+
+        // (sv is part of the string being escaped, or a constant)
+        void append(std::string_view sv)
+        {
+            if (sv.size() > ESCAPE_CHUNK / 2)
+            {
+                // (after the chars gathered so far)
+                if (mUsed)
+                    flush();
+                mOut = putInPlace(mOut, sv);
+                return;
+            }
+            if (mUsed + sv.size() > ESCAPE_CHUNK)
+                flush();
+            std::copy(sv.begin(), sv.end(), mBuf + mUsed);
+            mUsed += sv.size();
+        }
+
+        void escape(char c)
+        {
+            if (mUsed + 6 > ESCAPE_CHUNK)
+                flush();
+            mUsed += escapeChar(mBuf + mUsed, c);
+        }
+
+        OutputIt finish()
+        {
+            flush();
+            return mOut;
+        }
+    }; // class EscapeChunk
+
+    //
+    // Escape string the JSON way, writing directly into the output. Runs of
+    // chars which need no escaping are found by the scan function, and every
+    // char above ASCII is escaped.
+    //
+    template<typename OutputIt>
+    static OutputIt escape(OutputIt out,
+                           std::string_view strIn,
+                           JSONEscapeScan scan = ActiveJSONEscapeScan())
+    {
+        EscapeChunk<OutputIt> chunk(out);
+
+        size_t pos = 0;
+        while (pos < strIn.size())
+        {
+            const size_t run = scan(strIn.data() + pos, strIn.size() - pos);
+            chunk.append(strIn.substr(pos, run));
+            pos += run;
+
+            if (pos < strIn.size())
+                chunk.escape(strIn[pos++]);
+        }
+
+        return chunk.finish();
+    } // escape()
+
+    //
+    // Escape string the JSON way, but pass valid UTF-8 sequences through. The
+    // runs found by the (UTF-8) scan function are validated in bulk, and only
+    // a run which fails is walked sequence by sequence to replace or escape
+    // the invalid ones.
+    //
+    template<typename OutputIt>
+    static OutputIt escapeUTF8(OutputIt out,
+                               std::string_view strIn,
+                               bool replaceInvalid,
+                               JSONEscapeScan scan = ActiveJSONEscapeScan(true),
+                               UTF8Validate validate = ActiveUTF8Validate())
+    {
+        EscapeChunk<OutputIt> chunk(out);
+
+        size_t pos = 0;
+        while (pos < strIn.size())
+        {
+            const size_t run = scan(strIn.data() + pos, strIn.size() - pos);
+            const auto runStr = strIn.substr(pos, run);
+            if (validate(runStr.data(), runStr.size()))
+            {
+                chunk.append(runStr);
+            }
+            else
+            {
+                size_t i = 0;
+                while (i < runStr.size())
+                {
+                    bool valid;
+                    const size_t len = UTF8Sequence(runStr.data() + i, runStr.size() - i, valid);
+                    if (valid)
+                        chunk.append(runStr.substr(i, len));
+                    else if (replaceInvalid)
+                        chunk.append(UTF8_REPLACEMENT);
+                    else
+                        for (size_t j = 0; j < len; j++)
+                            chunk.escape(runStr[i + j]);
+                    i += len;
+                }
+            }
+            pos += run;
+
+            if (pos < strIn.size())
+                chunk.escape(strIn[pos++]);
+        }
+
+        return chunk.finish();
+    } // escapeUTF8()
+
+    // escape string as specified by the style (of either expansion type)
+    template<typename OutputIt, typename EXPANSION>
+    static OutputIt escape(OutputIt out,
+                           std::string_view strIn,
+                           const EXPANSION& expansion)
+    {
+        switch (expansion.mUtf8)
+        {
+        case JSU::UTF8_REPLACE:
+            return escapeUTF8(out, strIn, true);
+        case JSU::UTF8_ESCAPE:
+            return escapeUTF8(out, strIn, false);
+        default:
+            return escape(out, strIn);
+        }
+    }
+
+    template<typename OutputIt, typename EXPANSION>
+    static OutputIt writeString(OutputIt out,
+                                std::string_view str,
+                                const EXPANSION& expansion)
+    {
+        out = put(out, QUOTE);
+        out = escape(out, str, expansion);
+        return put(out, QUOTE);
+    }
+}; // struct JSONFormat
+
+//
+// Bounded cache of object keys already escaped and quoted, followed by the
+// separator before their values (when the style's gaps around it have no
+// newline), used by the 'k' per call parm so keys repeated in many records
+// (e.g. std::vector<std::map<std::string, X> >) are each written with a
+// single copy. Each thread has its own (see ThreadLocal()). Keys are found by
+// hash and compared in full, and each slot of the table holds the last key
+// which hashed to it, so the memory used is bounded by the slot count and
+// the longest key cached. The cache is emptied when the style changes.
+//
+class KeyCache
+{
+public:
+    struct Entry
+    {
+        size_t mHash = 0;
+        string mKey;
+        string mText;           // quoted key, then the separator if cached
+        size_t mQuotedSize = 0;
+        bool mSeparated = false;
+
+        std::string_view quoted() const
+        {
+            return std::string_view(mText).substr(0, mQuotedSize);
+        }
+    };
+
+private:
+    std::vector<Entry> mEntries;
+    const size_t mMaxKeySize;
+    VALUE_T mStyle = 0;
+
+public:
+    // (slots is rounded up to a power of 2)
+    explicit KeyCache(size_t slots = 1024, size_t maxKeySize = 64)
+      : mMaxKeySize(maxKeySize)
+    {
+        size_t count = 1;
+        while (count < slots)
+            count *= 2;
+        mEntries.resize(count);
+    }
+
+    static KeyCache& ThreadLocal()
+    {
+        thread_local KeyCache cache;
+        return cache;
+    }
+
+    void clear()
+    {
+        for (auto& entry : mEntries)
+            entry = Entry{};
+    }
+
+    //
+    // Quoted key, and whether the separator follows it, or nullptr if the key
+    // is too long to cache
+    //
+    template<typename EXPANSION>
+    const Entry* get(std::string_view key, const EXPANSION& expansion)
+    {
+        if (key.size() > mMaxKeySize)
+            return nullptr;
+
+        if (mStyle != expansion.mValue)
+        {
+            clear();
+            mStyle = expansion.mValue;
+        }
+
+        const size_t hash = std::hash<std::string_view>()(key);
+        auto& entry = mEntries[hash & (mEntries.size() - 1)];
+        if ((entry.mHash != hash) || (entry.mKey != key))
+        {
+            entry.mHash = hash;
+            entry.mKey.assign(key);
+            entry.mText.clear();
+            JSONFormat::writeString(std::back_inserter(entry.mText), key, expansion);
+            entry.mQuotedSize = entry.mText.size();
+
+            // (the separator of the first member uses other gaps, so only that
+            // of the others is cached)
+            const auto& before = expansion.mObjectGap[4];
+            const auto& after = expansion.mObjectGap[5];
+            entry.mSeparated = !before.mNewline && !after.mNewline;
+            if (entry.mSeparated)
+            {
+                entry.mText.append(before.mExtra);
+                entry.mText.push_back(JSONFormat::KEY_SEPARATOR);
+                entry.mText.append(after.mExtra);
+            }
+        }
+        return &entry;
+    } // get()
+}; // class KeyCache
+
+//
+// Behind-the-scenes workhorse based on JSONStyle
+//
+
+class JSONStyleHelper
+  : public StyleHelper
+{
+protected:
+    VALUE_T mLastStyleValue;
+    const JSONStyleExpansion* mpExpansion;
+
+public:
+    JSONStyleHelper(VALUE_T val = DEFAULTJSONCONFIG.value)
+      : StyleHelper(val ? val : DEFAULTJSONCONFIG.value),
+        mLastStyleValue(0),
+        mpExpansion(nullptr)
+    {
+        updateExpansions();
+    }
+
+    JSONStyleHelper& operator=(VALUE_T value)
+    {
+        mStyle.value = value;
+        updateExpansions();
+        return *this;
+    }
+
+    JSONStyleHelper& operator=(const JSONStyle& style)
     {
         mStyle.value = style.value;
         updateExpansions();
@@ -561,127 +2000,1382 @@ public:
     }
 
     //
-    // Functions used to escape string the JSON way (or just return the value
-    // if any other type)--Design needed to keep compiler happy below
+    // Functions used to escape string the JSON way (or just pass the value
+    // through by reference if any other type)--Design needed to keep compiler
+    // happy below
+    //
+    template<typename T>
+    const T& escapeIfString(const T& val) const
+    {
+        return val;
+    }
+    // escape string the JSON way
+    string escapeIfString(std::string_view strIn) const
+    {
+        string strOut;
+        strOut.reserve(strIn.length());
+        JSONFormat::escape(std::back_inserter(strOut), strIn, *mpExpansion);
+        return strOut;
+    } // escapeIfString()
+    // (these are needed to be chosen over the pass-through template above)
+    string escapeIfString(const string& strIn) const
+    {
+        return escapeIfString(std::string_view(strIn));
+    }
+    string escapeIfString(const char* strIn) const
+    {
+        return escapeIfString(std::string_view(strIn));
+    }
+
+    //
+    // Convert a style argument string to a style value, either a number or a
+    // registered style name prefixed by '@'
+    //
+    VALUE_T styleToValue(std::string_view sv) const
+    {
+        if (!sv.empty() && (sv.front() == '@'))
+            return NamedStyles::JSON().find(sv.substr(1));
+        return toValue<VALUE_T>(sv);
+    }
+
+    const JSONStyleExpansion& expansion() const
+    {
+        return *mpExpansion;
+    }
+
+    void updateExpansions()
+    {
+        if (!mLastStyleValue || (mLastStyleValue != mStyle.value))
+        {
+            mpExpansion = &JSONStyleExpansion::Get(mStyle.value);
+            mNewline = mpExpansion->mNewline;
+            mTab = mpExpansion->mTab;
+            mLastStyleValue = mStyle.value;
+        }
+    } // updateExpansions()
+}; // class JSONStyleHelper
+
+// Number of fmtster arguments (see Base::XXX_ARG_INDEX)
+constexpr size_t ARG_COUNT = 4;
+
+//
+// Number following a per call parm at pcp[i] (e.g. the count of the 'e' parm),
+// which is 0 if there are no digits and the count is optional (i is left at
+// the last of them)
+//
+constexpr size_t ParseCount(std::string_view pcp, size_t& i, bool required)
+{
+    const size_t start = i;
+    size_t limit = 0;
+    while ((i + 1 < pcp.size()) && (pcp[i + 1] >= '0') && (pcp[i + 1] <= '9'))
+    {
+        const size_t digit = size_t(pcp[++i] - '0');
+        if (limit > (std::numeric_limits<size_t>::max() - digit) / 10)
+            throw fmt::format_error("fmtster: per call parameter count is too large");
+        limit = (limit * 10) + digit;
+    }
+    if (required && (i == start))
+        throw fmt::format_error("fmtster: per call parameter needs a count");
+    return limit;
+}
+
+// Data provided and/or derived from in-brace formatting and used during the
+// serialization. This must be modified by parse() and format(), but the
+// formatter design declares parse() and format() as const member funtions.
+// So, this data is in its own object to allow manipulation during those calls.
+// It is held inline by Base (without any heap allocations), because a
+// formatter is built and parsed for each call.
+struct PerFmtsterData
+{
+    // From per call parms arg
+    bool mDisableBras;
+    bool mReverseMultimaps;
+    size_t mElideLimit;
+    size_t mThreads;
+    bool mKeyCache;
+    char mRecordLayout;
+
+    // From indent arg
+    size_t mIndentSetting;
+
+    // Results of parse() for use in format() (the argument data refers to the
+    // format string, which outlives the format() call)
+    std::array<std::string_view, ARG_COUNT> mArgData;
+    std::array<unsigned int, ARG_COUNT> mNestedArgIndex;
+
+    // From format arg (int due to code in formatToValue(const char*))
+    int mFormatSetting;
+
+    // From style arg
+    internal::JSONStyleHelper mStyleHelper;
+    internal::VALUE_T mStyleValue;
+
+    // Expanded indent strings (refer to the interned style expansions, or to
+    // mIndentStorage when deeper than JSONStyleExpansion::MAX_INDENT)
+    std::string_view mBraIndent;  // brace/bracket indent
+    std::string_view mDataIndent; // data indent
+    string mIndentStorage;
+
+    PerFmtsterData(internal::VALUE_T defaultStyleValue = 0,
+                   int defaultFormatSetting = 0) :
+        mDisableBras(false),
+        mReverseMultimaps(true),
+        mElideLimit(0),
+        mThreads(1),
+        mKeyCache(false),
+        mRecordLayout(0),
+        mIndentSetting(0),
+        mArgData{},
+        mNestedArgIndex{},
+        mFormatSetting(defaultFormatSetting),
+        mStyleHelper(defaultStyleValue),
+        mStyleValue(mStyleHelper.mStyle.value)
+    {}
+};
+
+//
+// Access to the underlying container of a container adapter (std::stack<>,
+// std::queue<>, std::priority_queue<>), which is a protected member
+//
+template <class ADAPTER>
+static typename ADAPTER::container_type const& GetAdapterContainer(const ADAPTER& a)
+{
+    struct hack : public ADAPTER
+    {
+        static typename ADAPTER::container_type const& Get(const ADAPTER& a)
+        {
+            return a.*&hack::c;
+        }
+    };
+
+    return hack::Get(a);
+} // GetAdapterContainer()
+
+//
+// Views of a container of records (see is_record<>) for the 'c' and 't' per
+// call parms, which the serializer writes like any other container: the
+// values of one field of every record, and the values of each record (each
+// of which is written as an array)
+//
+template<typename C, typename PROJECTION>
+class RecordView
+{
+    const C& mRecords;
+
+public:
+    using value_type = simplify_type<decltype(PROJECTION::Get(*std::declval<const C&>().begin()))>;
+
+    class const_iterator
+    {
+        typename C::const_iterator mIt;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = RecordView::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = decltype(PROJECTION::Get(*std::declval<const C&>().begin()));
+
+        explicit const_iterator(typename C::const_iterator it)
+          : mIt(it)
+        {}
+
+        reference operator*() const { return PROJECTION::Get(*mIt); }
+        const_iterator& operator++() { ++mIt; return *this; }
+        const_iterator operator++(int) { auto prev = *this; ++mIt; return prev; }
+        bool operator==(const const_iterator& other) const { return mIt == other.mIt; }
+        bool operator!=(const const_iterator& other) const { return mIt != other.mIt; }
+    };
+
+    explicit RecordView(const C& records)
+      : mRecords(records)
+    {}
+
+    const_iterator begin() const { return const_iterator(mRecords.begin()); }
+    const_iterator end() const { return const_iterator(mRecords.end()); }
+
+    template<typename CC = C, typename = decltype(std::declval<const CC&>().size())>
+    size_t size() const { return mRecords.size(); }
+}; // class RecordView
+
+template<size_t I>
+struct RecordField
+{
+    template<typename R>
+    static const auto& Get(const R& record) { return std::get<I>(record).second; }
+};
+
+template<typename R>
+struct RecordRow
+{
+    const R& mRecord;
+};
+
+struct RecordRows
+{
+    template<typename R>
+    static RecordRow<R> Get(const R& record) { return { record }; }
+};
+
+template<typename T>
+struct is_record_row
+  : false_type
+{};
+template<typename R>
+struct is_record_row<RecordRow<R> >
+  : true_type
+{};
+
+//
+// Single-pass serializer used by the fmtster fmt::formatter<>s. It walks
+// nested containers, pairs and tuples once, writing punctuation, indentation,
+// keys and values straight into the output iterator. Only types with their own
+// (custom) fmtster-based formatter are passed back through fmt::format_to().
+// FORMAT is the compile-time format policy (e.g. JSONFormat), and EXPANSION
+// is either its run-time style expansion or a compile-time one (e.g.
+// StaticJSONStyleExpansion<>).
+//
+template<typename FORMAT, typename EXPANSION = typename FORMAT::Expansion>
+class Serializer
+{
+    using Expansion = EXPANSION;
+
+    const Expansion& mExpansion;
+    const bool mReverseMultimaps;
+
+    // From the 'e' per call parm (0 for all elements)
+    const size_t mElideLimit;
+
+    // From the 'p' per call parm (1 to write serially)
+    const size_t mThreads;
+
+    // From the 'k' per call parm (the calling thread's KeyCache is used, so
+    // the threads of the 'p' per call parm each use their own)
+    const bool mKeyCache;
+
+    // From the 'c' or 't' per call parm ('c' or 't', or 0 for records written
+    // as objects)
+    const char mRecordLayout;
+
+    // Containers with fewer elements are always written serially
+    static constexpr size_t PARALLEL_THRESHOLD = 16 * 1024;
+
+    // Chunks written in parallel per thread (more than one, so threads which
+    // finish early take on the chunks left)
+    static constexpr size_t PARALLEL_CHUNKS = 4;
+
+    template<typename OutputIt>
+    OutputIt putIndent(OutputIt out, size_t indent) const
+    {
+        for (; indent > Expansion::MAX_INDENT; indent -= Expansion::MAX_INDENT)
+            out = put(out, mExpansion.indent(Expansion::MAX_INDENT));
+        return put(out, mExpansion.indent(indent));
+    }
+
+    //
+    // Budgeted output (see fmtster::format_to_n()) commits the end of each
+    // element, and the traversal stops once its budget is exhausted, counting
+    // the elements it never reached. (For any other output these are no-ops.)
+    //
+    template<typename OutputIt>
+    static constexpr bool IsBudgeted()
+    {
+        return std::is_same_v<OutputIt, SinkIterator<Budget> >;
+    }
+
+    template<typename OutputIt>
+    static bool commit(OutputIt out)
+    {
+        if constexpr (IsBudgeted<OutputIt>())
+            return out.sink().commit();
+        else
+            return true;
+    }
+
+    template<typename OutputIt>
+    static void omit(OutputIt out, size_t count)
+    {
+        if constexpr (IsBudgeted<OutputIt>())
+            out.sink().mOmitted += count;
+    }
+
+    // elements of the container after it, of which done have been reached
+    template<typename C, typename It>
+    static size_t Remaining(const C& c, It it, size_t done)
+    {
+        if constexpr (has_size_v<const C&>)
+            return c.size() - done;
+        else
+            return std::distance(it, c.end());
+    }
+
+    //
+    // Values which are not serialized by fmtster itself (numbers, bools,
+    // strings, etc.)
+    //
+    template<typename OutputIt, typename T>
+    OutputIt writeScalar(OutputIt out, const T& val) const
+    {
+        if constexpr (std::is_convertible_v<const T&, std::string_view>)
+        {
+            // std::string, std::string_view, const char* and char arrays are
+            // all escaped in place
+            if constexpr (std::is_pointer_v<T>)
+            {
+                if (!val)
+                    throw fmt::format_error("fmtster: string pointer is null");
+            }
+
+            std::string_view sv(val);
+            if constexpr (IsBudgeted<OutputIt>())
+            {
+                // every char is written as at least one char, so (allowing
+                // for a partial UTF-8 sequence at the cut) the rest of a
+                // long string is beyond the budget
+                if (sv.size() > out.sink().room() + 4)
+                    sv = sv.substr(0, out.sink().room() + 4);
+            }
+            return FORMAT::writeString(out, sv, mExpansion);
+        }
+        else if constexpr (is_string_v<T>)
+        {
+            // other types only convertible to std::string
+            const string str(val);
+            if constexpr (references_in_place<OutputIt>::value)
+            {
+                // (the temporary cannot be referenced, so is escaped into a
+                // copy)
+                string escaped;
+                FORMAT::writeString(std::back_inserter(escaped), str, mExpansion);
+                return put(out, escaped);
+            }
+            else
+            {
+                return FORMAT::writeString(out, str, mExpansion);
+            }
+        }
+        else
+        {
+            return fmt::format_to(out, "{}", val);
+        }
+    } // writeScalar()
+
+    //
+    // Gap of the style, given the depth of the enclosing brackets (which is -1
+    // for the first level of elements when the brackets are disabled). The
+    // newline is omitted from the gap before the first element when the
+    // brackets are disabled.
+    //
+    template<typename OutputIt>
+    OutputIt putGap(OutputIt out,
+                    const JSONGap& gap,
+                    std::ptrdiff_t depth,
+                    bool withNewline = true) const
+    {
+        if (!gap.mNewline)
+            return withNewline ? put(out, gap.mExtra) : out;
+
+        if (gap.mContiguous && (depth <= std::ptrdiff_t(Expansion::MAX_INDENT)))
+        {
+            const std::ptrdiff_t newlineSize = mExpansion.mNewline.size();
+            const std::ptrdiff_t size =
+                std::max<std::ptrdiff_t>(depth * std::ptrdiff_t(mExpansion.mTab.size()) +
+                                         std::ptrdiff_t(gap.mExtra.size()),
+                                         0);
+            const std::ptrdiff_t start = withNewline ? 0 : newlineSize;
+            return put(out, gap.mText.substr(start, newlineSize + size - start));
+        }
+
+        if (withNewline)
+            out = put(out, mExpansion.mNewline);
+        if (depth > 0)
+            out = putIndent(out, depth);
+        return put(out, gap.mExtra);
+    } // putGap()
+
+    // gaps before the first element, before each later one and before the
+    // closing bracket/brace
+    const JSONGap& leadingGap(bool braceable) const
+    {
+        return braceable ? mExpansion.mObjectGap[0] : mExpansion.mArrayGap[0];
+    }
+    const JSONGap& separatingGap(bool braceable) const
+    {
+        return braceable ? mExpansion.mObjectGap[3] : mExpansion.mArrayGap[1];
+    }
+    const JSONGap& trailingGap(bool braceable) const
+    {
+        return braceable ? mExpansion.mObjectGap[6] : mExpansion.mArrayGap[2];
+    }
+
+    //
+    // Whether an array/object of count elements of type E is written on a
+    // single line by the singleLineArray/singleLineObject options (i.e. it
+    // has a single element, which has no container value)
+    //
+    template<typename V>
+    static constexpr bool IsScalar()
+    {
+        if constexpr (is_cached_v<V>)
+            return IsScalar<simplify_type<typename V::value_type> >();
+        else
+            return !is_pair_v<V> &&
+                   !is_tuple_v<V> &&
+                   !is_record_row<V>::value &&
+                   !is_adapter_v<V> &&
+                   !is_container_v<V> &&
+                   !is_fmtsterable_v<V>;
+    }
+
+    template<typename E>
+    bool isSingleLine(bool braceable, size_t count, bool disableBras) const
+    {
+        using V = simplify_type<E>;
+
+        bool scalar;
+        if constexpr (is_pair_v<V>)
+            scalar = IsScalar<simplify_type<typename V::second_type> >();
+        else
+            scalar = IsScalar<V>();
+
+        const auto option = braceable
+                            ? mExpansion.mSingleLineObject
+                            : mExpansion.mSingleLineArray;
+        return scalar &&
+               (count == 1) &&
+               !disableBras &&
+               ((option == JSS::PACKED) || (option == JSS::SAMELINE));
+    }
+
+    template<typename OutputIt>
+    OutputIt putSingleLineGap(OutputIt out, bool braceable) const
+    {
+        const auto option = braceable
+                            ? mExpansion.mSingleLineObject
+                            : mExpansion.mSingleLineArray;
+        return (option == JSS::SAMELINE) ? put(out, ' ') : out;
+    }
+
+    //
+    // Gap (and comma) preceding an element of an array or object, whose data
+    // is at dataIndent
+    //
+    template<typename OutputIt>
+    OutputIt putElementGap(OutputIt out,
+                           bool braceable,
+                           size_t dataIndent,
+                           bool disableBras,
+                           bool isFirstElement,
+                           bool singleLine) const
+    {
+        if (!isFirstElement)
+        {
+            out = put(out, FORMAT::VALUE_SEPARATOR);
+            return putGap(out, separatingGap(braceable), std::ptrdiff_t(dataIndent) - 1);
+        }
+
+        if (singleLine)
+            return putSingleLineGap(out, braceable);
+
+        return putGap(out, leadingGap(braceable), std::ptrdiff_t(dataIndent) - 1, !disableBras);
+    }
+
+    //
+    // Key of an object member and its separator (gaps 2 and 3 surround the
+    // separator of the first member, and gaps 5 and 6 those of the others)
+    //
+    template<typename OutputIt>
+    OutputIt putKeySeparator(OutputIt out,
+                             size_t dataIndent,
+                             bool isFirstElement) const
+    {
+        out = putGap(out,
+                     mExpansion.mObjectGap[isFirstElement ? 1 : 4],
+                     std::ptrdiff_t(dataIndent) - 1);
+        out = put(out, FORMAT::KEY_SEPARATOR);
+        return putGap(out,
+                      mExpansion.mObjectGap[isFirstElement ? 2 : 5],
+                      std::ptrdiff_t(dataIndent) - 1);
+    }
+
+    template<typename OutputIt, typename K>
+    OutputIt writeKey(OutputIt out,
+                      const K& key,
+                      size_t dataIndent,
+                      bool isFirstElement) const
+    {
+        if constexpr (std::is_convertible_v<const K&, std::string_view> && !std::is_pointer_v<K>)
+        {
+            if (mKeyCache)
+            {
+                const auto pEntry = KeyCache::ThreadLocal().get(key, mExpansion);
+                if (pEntry)
+                {
+                    if (pEntry->mSeparated && !isFirstElement)
+                        return put(out, pEntry->mText);
+                    out = put(out, pEntry->quoted());
+                    return putKeySeparator(out, dataIndent, isFirstElement);
+                }
+            }
+        }
+
+        out = writeScalar(out, key);
+        return putKeySeparator(out, dataIndent, isFirstElement);
+    }
+
+    //
+    // Marker in place of the count elements elided by the 'e' per call parm
+    // (e.g. "... 999990 more"), which is a key with a null value in an object
+    //
+    template<typename OutputIt>
+    OutputIt writeElision(OutputIt out,
+                          bool braceable,
+                          size_t dataIndent,
+                          bool disableBras,
+                          size_t count) const
+    {
+        const fmt::format_int number(count);
+
+        out = putElementGap(out, braceable, dataIndent, disableBras, false, false);
+        out = put(out, FORMAT::QUOTE);
+        out = put(out, FORMAT::ELISION_PREFIX);
+        out = put(out, std::string_view(number.data(), number.size()));
+        out = put(out, FORMAT::ELISION_SUFFIX);
+        out = put(out, FORMAT::QUOTE);
+        if (braceable)
+        {
+            out = putKeySeparator(out, dataIndent, false);
+            out = put(out, FORMAT::NULL_VALUE);
+        }
+        return out;
+    } // writeElision()
+
+    // start of the last keep elements before end, which follow the elided
+    // elements from it
+    template<typename It>
+    static It SkipElided(It it, It end, size_t elided, size_t keep)
+    {
+        if constexpr (std::is_base_of_v<std::bidirectional_iterator_tag,
+                                        typename std::iterator_traits<It>::iterator_category>)
+            return std::prev(end, keep);
+        else
+            return std::next(it, elided);
+    }
+
+    //
+    // Single element of an array or object, with its preceding gap (and
+    // comma). std::pair<>s are written as object members.
+    //
+    template<typename OutputIt, typename E>
+    OutputIt writeElement(OutputIt out,
+                          const E& elem,
+                          bool braceable,
+                          size_t dataIndent,
+                          bool disableBras,
+                          bool isFirstElement,
+                          bool singleLine) const
+    {
+        out = putElementGap(out, braceable, dataIndent, disableBras, isFirstElement, singleLine);
+
+        if constexpr (is_pair_v<simplify_type<E> >)
+        {
+            out = writeKey(out, elem.first, dataIndent, isFirstElement);
+            out = write(out, elem.second, dataIndent, false);
+        }
+        else
+        {
+            out = write(out, elem, dataIndent, false);
+        }
+
+        return out;
+    } // writeElement()
+
+    //
+    // Opening and closing brackets/braces (if enabled). The container being
+    // opened is to be closed the way it is given (empty or on a single line),
+    // which a budget sets aside room for.
     //
-    template<typename T>
-    T escapeIfString(const T& val) const
+    template<typename OutputIt>
+    OutputIt open(OutputIt out,
+                  bool braceable,
+                  size_t indent,
+                  bool disableBras,
+                  bool empty,
+                  bool singleLine) const
     {
-        return val;
+        if (!disableBras)
+        {
+            out = put(out, braceable ? FORMAT::OBJECT_OPEN : FORMAT::ARRAY_OPEN);
+
+            if constexpr (IsBudgeted<OutputIt>())
+            {
+                const auto closeSize =
+                    close(CountingIterator(), braceable, indent, false, empty, singleLine).count();
+                out.sink().open({ braceable, indent, empty, singleLine, closeSize });
+            }
+        }
+        return out;
     }
-    // escape string the JSON way
-    string escapeIfString(const string& strIn) const
+
+    template<typename OutputIt>
+    OutputIt close(OutputIt out,
+                   bool braceable,
+                   size_t indent,
+                   bool disableBras,
+                   bool empty,
+                   bool singleLine) const
     {
-        string strOut;
-        strOut.reserve(strIn.length() * 6);
-        for (const char c : strIn)
+        if (!disableBras)
+        {
+            if (empty)
+                out = put(out, braceable ? mExpansion.mEmptyObject : mExpansion.mEmptyArray);
+            else if (singleLine)
+                out = putSingleLineGap(out, braceable);
+            else
+                out = putGap(out, trailingGap(braceable), indent);
+            out = put(out, braceable ? FORMAT::OBJECT_CLOSE : FORMAT::ARRAY_CLOSE);
+
+            if constexpr (IsBudgeted<OutputIt>())
+                out.sink().close();
+        }
+        return out;
+    }
+
+    //
+    // ALL CONTAINERS EXCEPT MULTIMAPS
+    // (This is able to be used for single data per element & map-like
+    // containers, because map-like containers use a std::pair<> for each
+    // element.)
+    //
+    template<typename OutputIt, typename C>
+    OutputIt writeContainer(OutputIt out,
+                            const C& c,
+                            size_t indent,
+                            bool disableBras) const
+    {
+        constexpr bool braceable = is_braceable_v<C>;
+        const size_t dataIndent = disableBras ? indent : indent + 1;
+
+        if constexpr (is_record_v<simplify_type<typename C::value_type> >)
         {
-            if ((c <= '\x1F') || (c >= '\x7F'))
+            if (mRecordLayout && (c.begin() != c.end()) && SameRecordKeys(c))
+                return writeRecords(out, c, indent, disableBras);
+        }
+
+        auto itC = c.begin();
+        const bool empty = (itC == c.end());
+        const bool singleLine =
+            !empty &&
+            isSingleLine<typename C::value_type>(braceable,
+                                                 (std::next(itC) == c.end()) ? 1 : 2,
+                                                 disableBras);
+
+        out = open(out, braceable, indent, disableBras, empty, singleLine);
+        // (with the 'e' per call parm, only the first and last elements are
+        // written, around a marker of the elided count)
+        size_t elided = 0;
+        if (mElideLimit && !empty)
+        {
+            const size_t size = Remaining(c, itC, 0);
+            if (size > 2 * mElideLimit)
+                elided = size - (2 * mElideLimit);
+        }
+
+        // (large containers may be written in chunks by several threads,
+        // unless each element is to be committed to a budget)
+        if constexpr (!IsBudgeted<OutputIt>())
+        {
+            if ((mThreads > 1) && !mElideLimit && !empty)
             {
-                switch (c)
+                const size_t size = Remaining(c, itC, 0);
+                if (size >= PARALLEL_THRESHOLD)
                 {
-                case '\b': strOut += R"(\b)"; break;
-                case '\f': strOut += R"(\f)"; break;
-                case '\n': strOut += R"(\n)"; break;
-                case '\r': strOut += R"(\r)"; break;
-                case '\t': strOut += R"(\t)"; break;
-                default:
-                    strOut += F(R"(\u{:04X})", (unsigned int)((unsigned char)c));
+                    out = writeParallel(out, c, size, braceable, dataIndent, disableBras);
+                    return close(out, braceable, indent, disableBras, false, false);
                 }
             }
-            else
+        }
+
+        for (size_t written = 0; itC != c.end(); )
+        {
+            if (elided && (written == mElideLimit))
             {
-                switch (c)
+                out = writeElision(out, braceable, dataIndent, disableBras, elided);
+                itC = SkipElided(itC, c.end(), elided, mElideLimit);
+                written += elided;
+                elided = 0;
+                if (!commit(out))
                 {
-                case '\\':   strOut += R"(\\)"; break;
-                case '\"':   strOut += R"(\")"; break;
-                case '/':    strOut += R"(\/)"; break;
-                case '\x7F': strOut += R"(\u007F)"; break;
-                default:     strOut += c;
+                    omit(out, Remaining(c, itC, written));
+                    return out;
                 }
             }
+
+            out = writeElement(out,
+                               *itC,
+                               braceable,
+                               dataIndent,
+                               disableBras,
+                               !written,
+                               singleLine);
+
+            ++itC;
+            if (!commit(out))
+            {
+                omit(out, Remaining(c, itC, ++written));
+                return out;
+            }
+            ++written;
         }
 
-        return strOut;
-    } // escapeIfString()
+        return close(out, braceable, indent, disableBras, empty, singleLine);
+    } // writeContainer()
 
-    void updateExpansions()
+    //
+    // Whether all the records of a container have the keys of the first one
+    // (which the 'c' and 't' per call parms write only once)
+    //
+    template<typename C>
+    static bool SameRecordKeys(const C& c)
     {
-        if (!mLastStyleValue || (mLastStyleValue != mStyle.value))
+        using Record = simplify_type<typename C::value_type>;
+
+        const auto& first = *c.begin();
+        return std::all_of(std::next(c.begin()), c.end(), [&first](const Record& record)
+            {
+                return std::apply([&first](const auto&... fields)
+                    {
+                        return std::apply([&fields...](const auto&... firstFields)
+                            {
+                                return ((std::string_view(fields.first) ==
+                                         std::string_view(firstFields.first)) && ...);
+                            },
+                            first);
+                    },
+                    record);
+            });
+    } // SameRecordKeys()
+
+    //
+    // (Non-empty) container of records with the same keys, written with each
+    // key once: as an object of one array per field ('c'), or as an object of
+    // an array of the keys and an array of the rows of values ('t')
+    //
+    template<typename OutputIt, typename C>
+    OutputIt writeRecords(OutputIt out,
+                          const C& c,
+                          size_t indent,
+                          bool disableBras) const
+    {
+        using Record = simplify_type<typename C::value_type>;
+        constexpr size_t FIELDS = std::tuple_size_v<Record>;
+
+        const auto& first = *c.begin();
+        if (mRecordLayout == 'c')
+        {
+            const auto columns = [&c, &first](auto... Is)
+            {
+                return std::make_tuple(
+                    std::make_pair(std::string_view(std::get<decltype(Is)::value>(first).first),
+                                   RecordView<C, RecordField<decltype(Is)::value> >(c))...);
+            };
+            return write(out,
+                         ApplyIndices(columns, std::make_index_sequence<FIELDS>{}),
+                         indent,
+                         disableBras);
+        }
+
+        const auto keys = [&first](auto... Is)
         {
-            const JSONStyle style(mStyle.value);
+            return std::array<std::string_view, FIELDS>{
+                std::string_view(std::get<decltype(Is)::value>(first).first)... };
+        };
+        return write(out,
+                     std::make_tuple(std::make_pair(FORMAT::RECORD_KEYS,
+                                                    ApplyIndices(keys, std::make_index_sequence<FIELDS>{})),
+                                     std::make_pair(FORMAT::RECORD_ROWS,
+                                                    RecordView<C, RecordRows>(c))),
+                     indent,
+                     disableBras);
+    } // writeRecords()
+
+    template<typename FN, size_t... Is>
+    static auto ApplyIndices(FN fn, std::index_sequence<Is...>)
+    {
+        return fn(std::integral_constant<size_t, Is>{}...);
+    }
 
-            if (style.cr)
-                mNewline = "\r";
-            if (style.lf)
-                mNewline += "\n";
+    //
+    // Values of a record, as an array (see the 't' per call parm)
+    //
+    template<typename OutputIt, typename R, size_t... Is>
+    OutputIt writeRecordRow(OutputIt out,
+                            const RecordRow<R>& row,
+                            size_t indent,
+                            std::index_sequence<Is...>) const
+    {
+        const size_t dataIndent = indent + 1;
+
+        bool singleLine = false;
+        if constexpr (sizeof...(Is) == 1)
+            singleLine = isSingleLine<std::tuple_element_t<0, R> >(false, 1, false);
+
+        out = open(out, false, indent, false, false, singleLine);
+        ((out = writeElement(out,
+                             std::get<Is>(row.mRecord).second,
+                             false,
+                             dataIndent,
+                             false,
+                             Is == 0,
+                             singleLine),
+          commit(out) || (omit(out, sizeof...(Is) - Is - 1), false)) && ...);
+        if (!commit(out))
+            return out;
+        return close(out, false, indent, false, false, singleLine);
+    } // writeRecordRow()
 
-            mTab = style.hardTab
-                   ? string(style.tabCount, '\t')
-                   : string(style.tabCount, ' ');
-            mLastStyleValue = mStyle.value;
+    //
+    // fmtster::Cached<> value, written with a single copy of its cached
+    // serialization, unless that was invalidated by a change or made at
+    // another indent or with other settings, in which case it is serialized
+    // again into the cache. (Output which is budgeted or only counted is
+    // written directly, without filling the cache.)
+    //
+    template<typename OutputIt, typename T>
+    OutputIt writeCached(OutputIt out,
+                         const Cached<T>& cached,
+                         size_t indent,
+                         bool disableBras) const
+    {
+        auto& fragment = cached.mFragment;
+        if (fragment.mValid &&
+            (fragment.mStyle == mExpansion.mValue) &&
+            (fragment.mIndent == indent) &&
+            (fragment.mDisableBras == disableBras) &&
+            (fragment.mReverseMultimaps == mReverseMultimaps) &&
+            (fragment.mElideLimit == mElideLimit) &&
+            (fragment.mRecordLayout == mRecordLayout))
+        {
+            return putInPlace(out, fragment.mText);
+        }
 
-#if false // @@@ TODO
+        if constexpr (IsBudgeted<OutputIt>() || std::is_same_v<OutputIt, CountingIterator>)
+        {
+            return write(out, cached.mValue, indent, disableBras);
+        }
+        else
+        {
+            // (the text's capacity is kept for the next serialization)
+            fragment.mValid = false;
+            fragment.mText.clear();
+            write(std::back_inserter(fragment.mText), cached.mValue, indent, disableBras);
+            fragment.mStyle = mExpansion.mValue;
+            fragment.mIndent = indent;
+            fragment.mDisableBras = disableBras;
+            fragment.mReverseMultimaps = mReverseMultimaps;
+            fragment.mElideLimit = mElideLimit;
+            fragment.mRecordLayout = mRecordLayout;
+            fragment.mValid = true;
+            return putInPlace(out, fragment.mText);
+        }
+    } // writeCached()
 
-            mArrayGap[0] = expand(style.gapA);
-            mArrayGap[1] = expand(style.gapB);
-            mArrayGap[2] = expand(style.gapB);
+    //
+    // Elements of a large container (of size elements), split into chunks
+    // which are written into strings of their own by a pool of threads (the
+    // calling thread among them), then joined in order. Each chunk starts with
+    // the gap of its first element, so joining them is only concatenation.
+    // The chunks are written serially, so nested containers are not split
+    // further.
+    //
+    template<typename OutputIt, typename C>
+    OutputIt writeParallel(OutputIt out,
+                           const C& c,
+                           size_t size,
+                           bool braceable,
+                           size_t dataIndent,
+                           bool disableBras) const
+    {
+        using It = typename C::const_iterator;
 
-            mObjectGap[0] = expand(style.gap1);
-            mObjectGap[1] = expand(style.gap2);
-            mObjectGap[2] = expand(style.gap3);
-            mObjectGap[3] = expand(style.gap4);
-            mObjectGap[4] = expand(style.gap5);
-            mObjectGap[5] = expand(style.gap6);
-            mObjectGap[6] = expand(style.gap7);
+        const size_t chunkCount = std::min(size, mThreads * PARALLEL_CHUNKS);
 
-            mEmptyArray = expand(style.emptyArray);
-            mEmptyObject = expand(style.emptyObject);
+        // (random access containers are split by index, and others by
+        // stepping through their nodes once)
+        std::vector<It> starts;
+        starts.reserve(chunkCount + 1);
+        It it = c.begin();
+        for (size_t i = 0; i < chunkCount; i++)
+        {
+            starts.push_back(it);
+            it = std::next(it, ((size * (i + 1)) / chunkCount) - ((size * i) / chunkCount));
+        }
+        starts.push_back(c.end());
 
-#endif // false
+        const Serializer serial(mExpansion, mReverseMultimaps, mElideLimit, 1, mKeyCache, mRecordLayout);
+        std::vector<string> chunks(chunkCount);
+        std::vector<std::exception_ptr> errors(chunkCount);
+        std::atomic<size_t> next(0);
+        const auto work = [&]()
+        {
+            for (size_t i; (i = next++) < chunkCount; )
+            {
+                try
+                {
+                    auto chunkOut = std::back_inserter(chunks[i]);
+                    for (It itChunk = starts[i]; itChunk != starts[i + 1]; ++itChunk)
+                    {
+                        chunkOut = serial.writeElement(chunkOut,
+                                                       *itChunk,
+                                                       braceable,
+                                                       dataIndent,
+                                                       disableBras,
+                                                       itChunk == starts[0],
+                                                       false);
+                    }
+                }
+                catch (...)
+                {
+                    errors[i] = std::current_exception();
+                }
+            }
+        };
 
+        std::vector<std::thread> pool;
+        pool.reserve(mThreads - 1);
+        try
+        {
+            while (pool.size() < std::min(mThreads, chunkCount) - 1)
+                pool.emplace_back(work);
         }
-    } // updateExpansions()
-}; // class JSONStyleHelper
+        catch (const std::system_error&)
+        {
+            // (those started, and this thread, take on all the chunks)
+        }
+        work();
+        for (auto& thread : pool)
+            thread.join();
 
-// Data provided and/or derived from in-brace formatting and used during the
-// serialization. This must be modified by parse() and format(), but the
-// formatter design declares parse() and format() as const member funtions.
-// So, this data is in its own object to allow manipulation during those calls.
-struct PerFmtsterData
-{
-    // From per call parms arg
-    bool mDisableBras;
+        for (const auto& error : errors)
+        {
+            if (error)
+                std::rethrow_exception(error);
+        }
+        for (const auto& chunk : chunks)
+            out = put(out, chunk);
+        return out;
+    } // writeParallel()
 
-    // From indent arg
-    size_t mIndentSetting;
+    //
+    // Values of count elements of a multimap, starting at first, in reverse
+    // order (written counts those already written). Forward-only iterators
+    // (e.g. std::unordered_multimap<>) are reversed by halves down to a small
+    // stack array, so no heap is needed.
+    //
+    template<typename OutputIt, typename It>
+    OutputIt writeReversedValues(OutputIt out,
+                                 It first,
+                                 size_t count,
+                                 size_t indent,
+                                 bool singleLine,
+                                 size_t& written) const
+    {
+        constexpr size_t DIRECT_COUNT = 16;
 
-    // Results of parse() for use in format()
-    vector<string> mArgData;
-    vector<unsigned int> mNestedArgIndex;
+        if (count > DIRECT_COUNT)
+        {
+            const size_t half = count / 2;
+            out = writeReversedValues(out, std::next(first, half), count - half, indent, singleLine, written);
+            if (!commit(out))
+                return out;
+            return writeReversedValues(out, first, half, indent, singleLine, written);
+        }
 
-    // From format arg (int due to code in formatToValue(const char*))
-    int mFormatSetting;
+        It its[DIRECT_COUNT];
+        for (size_t i = 0; i < count; i++, ++first)
+            its[i] = first;
+        while (count--)
+        {
+            out = writeElement(out,
+                               its[count]->second,
+                               false,
+                               indent,
+                               false,
+                               !written,
+                               singleLine);
+            written++;
+            if (!commit(out))
+                return out;
+        }
+        return out;
+    } // writeReversedValues()
 
-    // From style arg
-    std::unique_ptr<internal::StyleHelper> mpStyleHelper;
-    internal::VALUE_T mStyleValue;
+    //
+    // count values of a multimap from first to last, in the configured order
+    // (written counts the values of the key which have been written)
+    //
+    template<typename OutputIt, typename It>
+    OutputIt writeValues(OutputIt out,
+                         It first,
+                         It last,
+                         size_t count,
+                         size_t indent,
+                         bool singleLine,
+                         size_t& written) const
+    {
+        constexpr bool bidirectional =
+            std::is_base_of_v<std::bidirectional_iterator_tag,
+                              typename std::iterator_traits<It>::iterator_category>;
+
+        if (!mReverseMultimaps)
+        {
+            for (It it = first; (it != last) && commit(out); ++it, ++written)
+                out = writeElement(out, it->second, false, indent, false, !written, singleLine);
+        }
+        else if constexpr (bidirectional)
+        {
+            for (It it = last; (it != first) && commit(out); ++written)
+            {
+                --it;
+                out = writeElement(out, it->second, false, indent, false, !written, singleLine);
+            }
+        }
+        else
+        {
+            out = writeReversedValues(out, first, count, indent, singleLine, written);
+        }
+        return out;
+    } // writeValues()
 
-    // Expanded indent strings
-    string mBraIndent;  // brace/bracket indent
-    string mDataIndent; // data indent
+    //
+    // Start of the last keep keys of a multimap (each of which may have
+    // several elements), and the number of elements from there to the end
+    //
+    template<typename C>
+    static std::pair<typename C::const_iterator, size_t> TailKeys(const C& c, size_t keep)
+    {
+        using It = typename C::const_iterator;
 
-    PerFmtsterData(internal::VALUE_T defaultStyleValue = 0,
-                   int defaultFormatSetting = 0) :
-        mIndentSetting(0),
-        mDisableBras(false),
-        mArgData{ "" },
-        mNestedArgIndex{ 0 },
-        mFormatSetting(defaultFormatSetting),
-        mpStyleHelper(std::make_unique<internal::JSONStyleHelper>(defaultStyleValue)),
-        mStyleValue(mpStyleHelper->mStyle.value)
+        if constexpr (std::is_base_of_v<std::bidirectional_iterator_tag,
+                                        typename std::iterator_traits<It>::iterator_category>)
+        {
+            It it = c.end();
+            size_t count = 0;
+            for (; keep && (it != c.begin()); keep--)
+            {
+                const auto& key = std::prev(it)->first;
+                do
+                {
+                    --it;
+                    count++;
+                } while ((it != c.begin()) && (std::prev(it)->first == key));
+            }
+            return { it, count };
+        }
+        else
+        {
+            // (forward-only, so the keys are counted first)
+            size_t keys = 0;
+            for (It it = c.begin(); it != c.end(); keys++)
+                it = std::find_if(it, c.end(), [&key = it->first](const auto& e) { return !(e.first == key); });
+
+            It it = c.begin();
+            size_t skipped = 0;
+            for (; keys > keep; keys--)
+            {
+                const auto& key = it->first;
+                do
+                {
+                    ++it;
+                    skipped++;
+                } while ((it != c.end()) && (it->first == key));
+            }
+            return { it, c.size() - skipped };
+        }
+    } // TailKeys()
+
+    //
+    // MULTIMAPS (values sharing a key are grouped into an array, in reverse
+    // order unless disabled by the per call parms, iterating each range in
+    // place)
+    //
+    template<typename OutputIt, typename C>
+    OutputIt writeMultimap(OutputIt out,
+                           const C& c,
+                           size_t indent,
+                           bool disableBras) const
+    {
+        using It = typename C::const_iterator;
+
+        const size_t dataIndent = disableBras ? indent : indent + 1;
+
+        auto itC = c.begin();
+        const bool empty = (itC == c.end());
+
+        out = open(out, true, indent, disableBras, empty, false);
+
+        // (with the 'e' per call parm, only the first and last keys are
+        // written, around a marker of the elided count of elements)
+        It tail = c.end();
+        size_t tailIndex = c.size();
+        if (mElideLimit && (c.size() > 2 * mElideLimit))
+        {
+            const auto tailKeys = TailKeys(c, mElideLimit);
+            tail = tailKeys.first;
+            tailIndex -= tailKeys.second;
+        }
+
+        size_t reached = 0;
+        for (size_t keys = 0; itC != c.end(); keys++)
+        {
+            if (mElideLimit && (keys == mElideLimit) && (reached < tailIndex))
+            {
+                out = writeElision(out, true, dataIndent, disableBras, tailIndex - reached);
+                itC = tail;
+                reached = tailIndex;
+                if (!commit(out))
+                {
+                    omit(out, Remaining(c, itC, reached));
+                    return out;
+                }
+            }
+
+            const bool isFirstKey = (itC == c.begin());
+
+            // output the key
+            const auto& key = itC->first;
+            out = putElementGap(out, true, dataIndent, disableBras, isFirstKey, false);
+            out = writeKey(out, key, dataIndent, isFirstKey);
+
+            // find the range of values with the same key
+            const It first = itC;
+            size_t count = 0;
+            do
+            {
+                itC++;
+                count++;
+            } while ((itC != c.end()) && (itC->first == key));
+            reached += count;
+
+            // output the values as an array (eliding those in the middle, if
+            // there are too many)
+            const bool singleLine =
+                isSingleLine<typename C::mapped_type>(false, count, false);
+            out = open(out, false, dataIndent, false, false, singleLine);
+            size_t written = 0;
+            if (mElideLimit && (count > 2 * mElideLimit))
+            {
+                const size_t elided = count - (2 * mElideLimit);
+                const It head = std::next(first, mElideLimit);
+                const It tailValues = SkipElided(head, itC, elided, mElideLimit);
+
+                // (the last values are the first ones written in reverse)
+                if (mReverseMultimaps)
+                    out = writeValues(out, tailValues, itC, mElideLimit, dataIndent + 1, false, written);
+                else
+                    out = writeValues(out, first, head, mElideLimit, dataIndent + 1, false, written);
+                if (commit(out))
+                {
+                    out = writeElision(out, false, dataIndent + 1, false, elided);
+                    written += elided;
+                    if (commit(out))
+                    {
+                        if (mReverseMultimaps)
+                            out = writeValues(out, first, head, mElideLimit, dataIndent + 1, false, written);
+                        else
+                            out = writeValues(out, tailValues, itC, mElideLimit, dataIndent + 1, false, written);
+                    }
+                }
+            }
+            else
+            {
+                out = writeValues(out, first, itC, count, dataIndent + 1, singleLine, written);
+            }
+            if (!commit(out))
+            {
+                // (the values of the key, which were not all written, are
+                // counted along with the remaining entries)
+                omit(out, (count - written) + Remaining(c, itC, reached));
+                return out;
+            }
+            out = close(out, false, dataIndent, false, false, singleLine);
+            if (!commit(out))
+            {
+                omit(out, Remaining(c, itC, reached));
+                return out;
+            }
+        }
+
+        return close(out, true, indent, disableBras, empty, false);
+    } // writeMultimap()
+
+    // WARNING: a pair that doesn't have a string first is not JSON compliant
+    template<typename OutputIt, typename T1, typename T2>
+    OutputIt writePair(OutputIt out,
+                       const std::pair<T1, T2>& p,
+                       size_t indent,
+                       bool disableBras) const
+    {
+        const size_t dataIndent = disableBras ? indent : indent + 1;
+        const bool singleLine = isSingleLine<std::pair<T1, T2> >(true, 1, disableBras);
+
+        out = open(out, true, indent, disableBras, false, singleLine);
+        out = writeElement(out, p, true, dataIndent, disableBras, true, singleLine);
+
+        return close(out, true, indent, disableBras, false, singleLine);
+    } // writePair()
+
+    template<typename OutputIt, typename Tup, size_t... Is>
+    OutputIt writeTupleElements(OutputIt out,
+                                const Tup& tup,
+                                [[maybe_unused]] size_t indent,
+                                [[maybe_unused]] bool disableBras,
+                                [[maybe_unused]] bool singleLine,
+                                std::index_sequence<Is...>) const
+    {
+        // (the parameters are unused for an empty tuple)
+        // (stopping early if a budget is exhausted)
+        (void)((out = writeElement(out,
+                                   std::get<Is>(tup),
+                                   true,
+                                   indent,
+                                   disableBras,
+                                   Is == 0,
+                                   singleLine),
+                commit(out) || (omit(out, sizeof...(Is) - Is - 1), false)) && ...);
+        return out;
+    }
+
+    // std::tuple<> wraps group of heterogeneous objects known at compile time
+    template<typename OutputIt, typename... Ts>
+    OutputIt writeTuple(OutputIt out,
+                        const std::tuple<Ts...>& tup,
+                        size_t indent,
+                        bool disableBras) const
+    {
+        const size_t dataIndent = disableBras ? indent : indent + 1;
+
+        bool singleLine = false;
+        if constexpr (sizeof...(Ts) == 1)
+            singleLine = isSingleLine<Ts...>(true, 1, disableBras);
+
+        out = open(out, true, indent, disableBras, !sizeof...(Ts), singleLine);
+        out = writeTupleElements(out,
+                                 tup,
+                                 dataIndent,
+                                 disableBras,
+                                 singleLine,
+                                 std::index_sequence_for<Ts...>{});
+
+        if (!commit(out))
+            return out;
+        return close(out, true, indent, disableBras, !sizeof...(Ts), singleLine);
+    } // writeTuple()
+
+public:
+    // (threads is 0 for as many as the hardware runs at once)
+    Serializer(const Expansion& expansion,
+               bool reverseMultimaps = true,
+               size_t elideLimit = 0,
+               size_t threads = 1,
+               bool keyCache = false,
+               char recordLayout = 0)
+      : mExpansion(expansion),
+        mReverseMultimaps(reverseMultimaps),
+        mElideLimit(elideLimit),
+        mThreads(threads ? threads : std::max(std::thread::hardware_concurrency(), 1u)),
+        mKeyCache(keyCache),
+        mRecordLayout(recordLayout)
     {}
-};
+
+    //
+    // Close the brackets/braces left open when a budget was exhausted
+    // (outermost first)
+    //
+    template<typename OutputIt>
+    OutputIt closeLevels(OutputIt out, const std::vector<Budget::Level>& levels) const
+    {
+        for (auto it = levels.rbegin(); it != levels.rend(); ++it)
+            out = close(out, it->mBraceable, it->mIndent, false, it->mEmpty, it->mSingleLine);
+        return out;
+    }
+
+    //
+    // Serialize any value as if by the fmtster formatter for its type, given
+    // the (resolved) indent setting and per call brace setting
+    //
+    template<typename OutputIt, typename T>
+    OutputIt write(OutputIt out,
+                   const T& val,
+                   size_t indent,
+                   bool disableBras) const
+    {
+        using V = simplify_type<T>;
+
+        if constexpr (is_cached_v<V>)
+        {
+            return writeCached(out, val, indent, disableBras);
+        }
+        else if constexpr (is_record_row<V>::value)
+        {
+            return writeRecordRow(out,
+                                  val,
+                                  indent,
+                                  std::make_index_sequence<std::tuple_size_v<simplify_type<decltype(val.mRecord)> > >{});
+        }
+        else if constexpr (is_pair_v<V>)
+        {
+            return writePair(out, val, indent, disableBras);
+        }
+        else if constexpr (is_tuple_v<V>)
+        {
+            return writeTuple(out, val, indent, disableBras);
+        }
+        else if constexpr (is_adapter_v<V>)
+        {
+            return write(out, GetAdapterContainer(val), indent, disableBras);
+        }
+        else if constexpr (conjunction_v<is_container<V>, is_multimappish<V> >)
+        {
+            return writeMultimap(out, val, indent, disableBras);
+        }
+        else if constexpr (is_container_v<V>)
+        {
+            return writeContainer(out, val, indent, disableBras);
+        }
+        else if constexpr (is_fmtsterable_v<V>)
+        {
+            // custom fmtster-based formatter
+            static constexpr std::string_view PCP[] = { "", "-b", "-r", "-b-r" };
+            std::string_view pcp = PCP[disableBras + 2 * !mReverseMultimaps];
+            char pcpBuffer[64];
+            if (mElideLimit || (mThreads > 1) || mKeyCache || mRecordLayout)
+            {
+                char* end = std::copy(pcp.begin(), pcp.end(), pcpBuffer);
+                if (mElideLimit)
+                    end = fmt::format_to(end, "e{}", mElideLimit);
+                if (mThreads > 1)
+                    end = fmt::format_to(end, "p{}", mThreads);
+                if (mKeyCache)
+                    *end++ = 'k';
+                if (mRecordLayout)
+                    *end++ = mRecordLayout;
+                pcp = std::string_view(pcpBuffer, end - pcpBuffer);
+            }
+            return fmt::format_to(out,
+                                  "{:{},{},{},{}}",
+                                  val,
+                                  indent,
+                                  pcp,
+                                  mExpansion.mValue,
+                                  FORMAT::INDEX);
+        }
+        else
+        {
+            return writeScalar(out, val);
+        }
+    } // write()
+}; // class Serializer
 
 } // namespace internal
 
@@ -698,31 +3392,51 @@ protected:
     static constexpr size_t STYLE_ARG_INDEX = 2;
     static constexpr size_t FORMAT_ARG_INDEX = 3;
 
-    std::unique_ptr<internal::PerFmtsterData> mpData;
+    internal::PerFmtsterData mData;
 
-    static int& DefaultFormat()
+    // Kept for formatters derived from Base, which use "auto& d = *mpData;"
+    internal::PerFmtsterData* const mpData;
+
+    //
+    // User-defined defaults, set by the 'f' and 's' per call parms. They are
+    // plain values (the expansion of a style value is immutable and shared by
+    // the expansion cache), so they are published atomically, and read
+    // without locking, on every call.
+    //
+    static std::atomic<int>& DefaultFormat()
     {
-        static int defaultFormat = 0;
+        static std::atomic<int> defaultFormat(0);
         return defaultFormat;
     };
 
-    static internal::JSONStyleHelper& DefaultJSONStyleHelper()
+    static std::atomic<internal::VALUE_T>& DefaultJSONStyleValue()
+    {
+        static_assert(std::atomic<internal::VALUE_T>::is_always_lock_free,
+                      "fmtster: the default style must be lock-free (keep JSONSTYLESTRUCT within 64 bits)");
+        static std::atomic<internal::VALUE_T> defaultStyleValue(DEFAULTJSONCONFIG.value);
+        return defaultStyleValue;
+    };
+
+    // style of the calling thread's fmtster::ScopedStyle (0 if none)
+    static internal::VALUE_T& ScopedJSONStyleValue()
     {
-        static internal::JSONStyleHelper defaultStyleHelper(0);
-        return defaultStyleHelper;
+        thread_local internal::VALUE_T scopedStyleValue = 0;
+        return scopedStyleValue;
     };
 
+    friend class ScopedStyle;
+
     // Function to pass along string to specified format type helper for
     // escaping
     template<typename T>
-    T escapeIfString(int format, const T& val) const
+    decltype(auto) escapeIfString(int format, const T& val) const
     {
         auto& d = *mpData;
 
         switch (format)
         {
         case 0:
-            return dynamic_cast<internal::JSONStyleHelper*>(d.mpStyleHelper.get())->escapeIfString(val);
+            return d.mStyleHelper.escapeIfString(val);
 
         default:
             throw fmt::format_error(F("fmtster: Shouldn't get here ({}), because unsupported format should have already been thrown", __LINE__));
@@ -735,23 +3449,32 @@ public:
     //
     static int GetDefaultFormat()
     {
-        return DefaultFormat();
+        return DefaultFormat().load(std::memory_order_acquire);
     }
 
-    static const JSONStyle& GetDefaultJSONStyle()
+    // (the calling thread's fmtster::ScopedStyle, if any)
+    static JSONStyle GetDefaultJSONStyle()
     {
-        return DefaultJSONStyleHelper().mStyle.jsonStyle;
+        const internal::VALUE_T scoped = ScopedJSONStyleValue();
+        return scoped ? scoped : DefaultJSONStyleValue().load(std::memory_order_acquire);
     }
 
     Base() :
-        mpData(
-            std::make_unique<internal::PerFmtsterData>(
-                GetDefaultJSONStyle().value,
-                GetDefaultFormat()
-            )
-        )
+        mData(GetDefaultJSONStyle().value, GetDefaultFormat()),
+        mpData(&mData)
+    {}
+
+    Base(const Base& other) :
+        mData(other.mData),
+        mpData(&mData)
     {}
 
+    Base& operator=(const Base& other)
+    {
+        mData = other.mData;
+        return *this;
+    }
+
     //
     // Generic parser for however many comma-separated arguments are provided,
     // including support for nested arguments (requires call to
@@ -762,15 +3485,18 @@ public:
     {
         auto& d = *mpData;
 
-        int parmIndex = 0;
+        size_t parmIndex = 0;
         int braces = 1;
         auto it = ctx.begin();
+        auto itArg = it;
         while (it != ctx.end())
         {
             const auto c = *it;
             if (c == '{')
             {
-                d.mNestedArgIndex[parmIndex] = ctx.next_arg_id();
+                const unsigned int argId = ctx.next_arg_id();
+                if (parmIndex < internal::ARG_COUNT)
+                    d.mNestedArgIndex[parmIndex] = argId;
                 braces++;
             }
             else if (c == '}')
@@ -779,18 +3505,17 @@ public:
                 if (!braces)
                     break;
             }
-            else if (c == ',')
-            {
-                parmIndex++;
-                d.mArgData.resize(parmIndex + 1);
-                d.mNestedArgIndex.resize(parmIndex + 1);
-            }
-            else
+            else if (c == ',')
             {
-                d.mArgData[parmIndex] += c;
+                if (parmIndex < internal::ARG_COUNT)
+                    d.mArgData[parmIndex] = std::string_view(itArg, it - itArg);
+                parmIndex++;
+                itArg = it + 1;
             }
             it++;
         }
+        if (parmIndex < internal::ARG_COUNT)
+            d.mArgData[parmIndex] = std::string_view(itArg, it - itArg);
 
         return it;
 
@@ -810,10 +3535,6 @@ public:
 
         auto& d = *mpData;
 
-        // ensure vectors are large enough for unchecked processing below
-        d.mArgData.resize(4, "");
-        d.mNestedArgIndex.resize(4, 0);
-
         //
         // Resolve each argument
         //
@@ -836,11 +3557,11 @@ public:
                     if constexpr (std::is_integral_v<val_t>)
                     {
                         // Check for supported formats.
-                        return d.mpStyleHelper->formatToValue(value);
+                        return d.mStyleHelper.formatToValue(value);
                     }
                     else if constexpr (internal::is_string_v<val_t>)
                     {
-                        return d.mpStyleHelper->formatToValue(value); // to convert formats
+                        return d.mStyleHelper.formatToValue(value); // to convert formats
                     }
                     else
                     {
@@ -854,7 +3575,7 @@ public:
         }
         else if(!d.mArgData[FORMAT_ARG_INDEX].empty())
         {
-            d.mFormatSetting = d.mpStyleHelper->formatToValue(d.mArgData[FORMAT_ARG_INDEX]);
+            d.mFormatSetting = d.mStyleHelper.formatToValue(d.mArgData[FORMAT_ARG_INDEX]);
         }
         else
         {
@@ -871,20 +3592,29 @@ public:
         {
             auto styleArg = ctx.arg(d.mNestedArgIndex[STYLE_ARG_INDEX]);
             styleSetting = styleArg.visit(
-                [](auto value) -> VALUE_T
+                [&d](auto value) -> VALUE_T
                 {
                     // This construct is required because at compile time all
                     //  type paths are linked, even though they are not allowed
                     //  at run time, and without this, the return value doens't
                     //  match the function return value in some cases, so the
                     //  compile fails.
-                    if constexpr (std::is_integral_v<simplify_type<decltype(value)> >)
+                    using val_t = simplify_type<decltype(value)>;
+                    if constexpr (std::is_integral_v<val_t>)
                     {
                         return value;
                     }
+                    else if constexpr (std::is_same_v<val_t, const char*>)
+                    {
+                        return d.mStyleHelper.styleToValue(value);
+                    }
+                    else if constexpr (std::is_same_v<val_t, fmt::basic_string_view<char> >)
+                    {
+                        return d.mStyleHelper.styleToValue(std::string_view(value.data(), value.size()));
+                    }
                     else
                     {
-                        throw fmt::format_error(F("fmtster: unsupported nested argument type for style: {} (only integers accepted--pass XXXStyle.value, not XXXStyle)",
+                        throw fmt::format_error(F("fmtster: unsupported nested argument type for style: {} (only integers and style names accepted--pass XXXStyle.value, not XXXStyle)",
                                                   typeid(value).name()));
                     }
                 }
@@ -892,7 +3622,7 @@ public:
         }
         else if(!d.mArgData[STYLE_ARG_INDEX].empty())
         {
-            auto styleSetting = d.mpStyleHelper->toValue<VALUE_T>(d.mArgData[STYLE_ARG_INDEX]);
+            styleSetting = d.mStyleHelper.styleToValue(d.mArgData[STYLE_ARG_INDEX]);
         }
 
         switch (d.mFormatSetting)
@@ -900,14 +3630,14 @@ public:
         case 0:
             if (!styleSetting)
                 styleSetting = GetDefaultJSONStyle().value;
-            d.mpStyleHelper.reset(new internal::JSONStyleHelper(styleSetting));
+            d.mStyleHelper = styleSetting;
             break;
 
         default:
             throw fmt::format_error("fmtster (style): Shouldn't get here, because unsupported format should have already been thrown");
         }
 
-        d.mStyleValue = d.mpStyleHelper->mStyle.value;
+        d.mStyleValue = d.mStyleHelper.mStyle.value;
 
 
 
@@ -915,18 +3645,22 @@ public:
         //
         // perm call parms
         //
-        string pcpSetting;
+        std::string_view pcpSetting;
         if (d.mNestedArgIndex[PER_CALL_ARG_INDEX])
         {
             auto pcpArg = ctx.arg(d.mNestedArgIndex[PER_CALL_ARG_INDEX]);
             pcpSetting = pcpArg.visit(
-                [](auto value) -> string
+                [](auto value) -> std::string_view
                 {
-                    if constexpr (std::disjunction_v<std::is_same<simplify_type<const char*>, simplify_type<decltype(value)> >,
-                                                     fmtster::internal::is_string<simplify_type<decltype(value)> > >)
+                    using val_t = simplify_type<decltype(value)>;
+                    if constexpr (std::is_same_v<val_t, const char*>)
                     {
                         return value;
                     }
+                    else if constexpr (std::is_same_v<val_t, fmt::basic_string_view<char> >)
+                    {
+                        return std::string_view(value.data(), value.size());
+                    }
                     else
                     {
                         throw fmt::format_error(F("fmtster: unsupported nested argument type for per call parameters: {} (only strings accepted)",
@@ -968,7 +3702,7 @@ public:
         else if (!d.mArgData[INDENT_ARG_INDEX].empty())
         {
             d.mIndentSetting =
-                d.mpStyleHelper->toValue<decltype(d.mIndentSetting)>(d.mArgData[INDENT_ARG_INDEX]);
+                d.mStyleHelper.toValue<decltype(d.mIndentSetting)>(d.mArgData[INDENT_ARG_INDEX]);
         }
         else
         {
@@ -978,31 +3712,66 @@ public:
 
 
 
-        d.mpStyleHelper->updateExpansions();
-
         //
         // Configure indentation
         //
-        d.mBraIndent.clear();
-        for (auto i = d.mIndentSetting; i; --i)
-            d.mBraIndent += d.mpStyleHelper->mTab;
-        d.mDataIndent = d.mBraIndent + d.mpStyleHelper->mTab;
+        if (d.mIndentSetting < JSONStyleExpansion::MAX_INDENT)
+        {
+            d.mBraIndent = d.mStyleHelper.expansion().indent(d.mIndentSetting);
+            d.mDataIndent = d.mStyleHelper.expansion().indent(d.mIndentSetting + 1);
+        }
+        else
+        {
+            d.mIndentStorage.clear();
+            for (auto i = d.mIndentSetting + 1; i; --i)
+                d.mIndentStorage += d.mStyleHelper.mTab;
+            d.mDataIndent = d.mIndentStorage;
+            d.mBraIndent = d.mDataIndent.substr(0, d.mIndentSetting * d.mStyleHelper.mTab.size());
+        }
 
         //
         // Parse the per call parms
         //
         bool negate = false;
-        for (const auto c : pcpSetting)
+        for (size_t i = 0; i < pcpSetting.size(); i++)
         {
+            const auto c = pcpSetting[i];
             switch (c)
             {
             case 'b':
                 d.mDisableBras = negate;
                 break;
 
+            case 'r':
+                d.mReverseMultimaps = !negate;
+                break;
+
+            case 'e':
+            {
+                const auto limit = internal::ParseCount(pcpSetting, i, !negate);
+                d.mElideLimit = negate ? 0 : limit;
+                break;
+            }
+
+            case 'p':
+            {
+                const auto threads = internal::ParseCount(pcpSetting, i, false);
+                d.mThreads = negate ? 1 : threads;
+                break;
+            }
+
+            case 'k':
+                d.mKeyCache = !negate;
+                break;
+
+            case 'c':
+            case 't':
+                d.mRecordLayout = negate ? 0 : c;
+                break;
+
             case 'f':
                 if (!negate)
-                    DefaultFormat() = d.mFormatSetting;
+                    DefaultFormat().store(d.mFormatSetting, std::memory_order_release);
                 break;
 
             case 's':
@@ -1011,7 +3780,8 @@ public:
                     switch (d.mFormatSetting)
                     {
                     case 0:
-                        DefaultJSONStyleHelper() = *dynamic_cast<JSONStyleHelper*>(d.mpStyleHelper.get());
+                        DefaultJSONStyleValue().store(d.mStyleHelper.mStyle.value,
+                                                      std::memory_order_release);
                         break;
 
                     default:
@@ -1024,196 +3794,1085 @@ public:
                 ;
             }
 
-            negate = (c == '-');
+            negate = (c == '-');
+
+        } /// for(size_t i = 0; i < pcpSetting.size(); i++)
+
+    } // resolveArgs()
+
+    //
+    // Serializes the value into the output iterator according to the resolved
+    // arguments (Base::resolveArgs() must have been called first)
+    //
+    template<typename OutputIt, typename T>
+    OutputIt serialize(OutputIt out, const T& val) const
+    {
+        auto& d = *mpData;
+
+        switch (d.mFormatSetting)
+        {
+        case internal::JSONFormat::INDEX:
+            return internal::Serializer<internal::JSONFormat>(d.mStyleHelper.expansion(),
+                                                              d.mReverseMultimaps,
+                                                              d.mElideLimit,
+                                                              d.mThreads,
+                                                              d.mKeyCache,
+                                                              d.mRecordLayout)
+                .write(out, val, d.mIndentSetting, d.mDisableBras);
+
+        default:
+            throw fmt::format_error(F("fmtster: Shouldn't get here ({}), because unsupported format should have already been thrown", __LINE__));
+        }
+    } // serialize()
+
+}; // struct FmtterBase
+
+//
+// Override of the default style on the calling thread only, while in scope
+// (e.g. for one request handler), which other threads and the 's' per call
+// parm do not affect. Nested overrides restore the one they replaced.
+//
+class ScopedStyle
+{
+    const internal::VALUE_T mPrevious;
+
+public:
+    explicit ScopedStyle(const JSONStyle& style)
+      : mPrevious(Base::ScopedJSONStyleValue())
+    {
+        Base::ScopedJSONStyleValue() = style.value;
+    }
+
+    ScopedStyle(const ScopedStyle&) = delete;
+    ScopedStyle& operator=(const ScopedStyle&) = delete;
+
+    ~ScopedStyle()
+    {
+        Base::ScopedJSONStyleValue() = mPrevious;
+    }
+}; // class ScopedStyle
+
+// (see the 'k' per call parm, e.g. fmtster::KeyCache::ThreadLocal().clear())
+using KeyCache = internal::KeyCache;
+
+//
+// Value whose serialization is cached, so that when a large structure is
+// serialized repeatedly, each unchanged Cached<> subtree is written with a
+// single copy of its previous serialization. Changes must be made through
+// modify() or set() (or be followed by invalidate()), which includes those to
+// a Cached<> nested within this one, e.g.:
+//     state.modify()["key"].modify().push_back(value);
+// One serialization is cached, made at the indent and with the style and per
+// call parms last used, so a subtree serialized at another depth (or with
+// other settings) is serialized again. A Cached<> must not be serialized by
+// several threads at once.
+//
+template<typename T>
+class Cached
+{
+    T mValue;
+
+    // (the last serialization, and what it was made with)
+    struct Fragment
+    {
+        string mText;
+        internal::VALUE_T mStyle = 0;
+        size_t mIndent = 0;
+        bool mDisableBras = false;
+        bool mReverseMultimaps = true;
+        size_t mElideLimit = 0;
+        char mRecordLayout = 0;
+        bool mValid = false;
+    };
+    mutable Fragment mFragment;
+
+    template<typename FORMAT, typename EXPANSION>
+    friend class internal::Serializer;
+
+public:
+    using value_type = T;
+
+    Cached() = default;
+
+    template<typename... Args>
+    explicit Cached(std::in_place_t, Args&&... args)
+      : mValue(std::forward<Args>(args)...)
+    {}
+
+    Cached(T value)
+      : mValue(std::move(value))
+    {}
+
+    const T& get() const { return mValue; }
+    const T& operator*() const { return mValue; }
+    const T* operator->() const { return &mValue; }
+
+    // (the reference is not to be kept for changes after serialization)
+    T& modify()
+    {
+        mFragment.mValid = false;
+        return mValue;
+    }
+
+    void set(T value)
+    {
+        modify() = std::move(value);
+    }
+
+    void invalidate()
+    {
+        mFragment.mValid = false;
+    }
+}; // class Cached
+
+//
+// Register a JSON style under a short name, so it can be referenced by a
+// format string as "@name" (e.g. "{:,,@compact}") instead of passing its value
+// as a nested argument (registering an existing name replaces its style)
+//
+inline void RegisterJSONStyle(std::string_view name, const JSONStyle& style)
+{
+    internal::NamedStyles::JSON().add(name, style.value);
+}
+
+namespace internal
+{
+
+//
+// Base of the types created by FMTSTER_COMPILE(), each of which provides its
+// format string from a static constexpr value() function
+//
+struct CompiledString
+{};
+
+//
+// Format string arguments parsed at compile time (see FMTSTER_COMPILE())
+//
+struct CompiledSpec
+{
+    std::string_view prefix;      // literal text before the braces
+    std::string_view suffix;      // literal text after the braces
+    size_t indent = 0;
+    bool disableBras = false;
+    bool reverseMultimaps = true;
+    size_t elideLimit = 0;        // 0 for all elements
+    size_t threads = 1;           // 0 for as many as the hardware runs
+    bool keyCache = false;
+    char recordLayout = 0;        // 'c' or 't' to write records in columns
+    VALUE_T style = 0;            // 0 for the default style when called
+    int format = -1;              // -1 for the default format when called
+};
+
+constexpr VALUE_T ParseCompiledNumber(std::string_view sv)
+{
+    VALUE_T val = 0;
+    for (const char c : sv)
+    {
+        if ((c > '9') || (c < '0'))
+            throw fmt::format_error("fmtster: compiled format arguments must be literal numbers");
+        val = (val * 10) + (c - '0');
+    }
+    return val;
+}
+
+//
+// Parse a format string holding a single fmtster replacement field (with
+// optional literal text around it, which must not contain braces). Errors
+// throw, which fails the compile when evaluated as a constant expression.
+//
+constexpr CompiledSpec ParseCompiledSpec(std::string_view fmtStr)
+{
+    CompiledSpec spec;
+
+    const size_t open = fmtStr.find('{');
+    const size_t close = fmtStr.find('}');
+    if ((open == std::string_view::npos) || (close == std::string_view::npos) ||
+        (close < open))
+        throw fmt::format_error("fmtster: compiled format string needs one replacement field");
+    spec.prefix = fmtStr.substr(0, open);
+    spec.suffix = fmtStr.substr(close + 1);
+    if (spec.suffix.find_first_of("{}") != std::string_view::npos)
+        throw fmt::format_error("fmtster: compiled format string needs one replacement field");
+
+    auto args = fmtStr.substr(open + 1, close - open - 1);
+    if (args.find('{') != std::string_view::npos)
+        throw fmt::format_error("fmtster: nested arguments are not supported in compiled format strings");
+    if (!args.empty())
+    {
+        if (args.front() != ':')
+            throw fmt::format_error("fmtster: compiled format string arguments must follow ':'");
+        args.remove_prefix(1);
+    }
+
+    for (size_t argIndex = 0; !args.empty() || (argIndex == 0); argIndex++)
+    {
+        const size_t comma = args.find(',');
+        const auto arg = args.substr(0, comma);
+        args = (comma == std::string_view::npos) ? std::string_view() : args.substr(comma + 1);
+
+        switch (argIndex)
+        {
+        case 0:
+            spec.indent = ParseCompiledNumber(arg);
+            break;
+
+        case 1:
+        {
+            bool negate = false;
+            for (size_t i = 0; i < arg.size(); i++)
+            {
+                const char c = arg[i];
+                if (c == 'b')
+                    spec.disableBras = negate;
+                else if (c == 'r')
+                    spec.reverseMultimaps = !negate;
+                else if (c == 'e')
+                {
+                    const auto limit = ParseCount(arg, i, !negate);
+                    spec.elideLimit = negate ? 0 : limit;
+                }
+                else if (c == 'p')
+                {
+                    const auto threads = ParseCount(arg, i, false);
+                    spec.threads = negate ? 1 : threads;
+                }
+                else if (c == 'k')
+                    spec.keyCache = !negate;
+                else if ((c == 'c') || (c == 't'))
+                    spec.recordLayout = negate ? 0 : c;
+                else if ((c == 'f') || (c == 's'))
+                    throw fmt::format_error("fmtster: changing defaults is not supported in compiled format strings");
+                negate = (c == '-');
+            }
+            break;
+        }
+
+        case 2:
+            if (!arg.empty() && (arg.front() == '@'))
+                throw fmt::format_error("fmtster: style names are not supported in compiled format strings");
+            spec.style = ParseCompiledNumber(arg);
+            break;
+
+        case 3:
+            if (arg.empty())
+                spec.format = -1;
+            else if ((arg.front() == 'j') || (arg.front() == 'J') ||
+                     (ParseCompiledNumber(arg) == 0))
+                spec.format = 0;
+            else
+                throw fmt::format_error("fmtster: unsupported format argument value");
+            break;
+
+        default:
+            break;
+        }
+
+        if (comma == std::string_view::npos)
+            break;
+    }
+
+    return spec;
+} // ParseCompiledSpec()
+
+//
+// Serializer entry point for compile-time arguments, which are template
+// parameters so each call site gets code for only its own settings
+//
+template<size_t INDENT,
+         bool DISABLE_BRAS,
+         bool REVERSE_MULTIMAPS,
+         size_t ELIDE_LIMIT,
+         size_t THREADS,
+         bool KEY_CACHE,
+         char RECORD_LAYOUT,
+         VALUE_T STYLE,
+         int FORMAT>
+struct CompiledFormatter
+{
+    template<typename OutputIt, typename T>
+    static OutputIt format_to(OutputIt out, const T& val)
+    {
+        if constexpr (FORMAT < 0)
+        {
+            if (Base::GetDefaultFormat() != JSONFormat::INDEX)
+                throw fmt::format_error(F("fmtster: unsupported format: {}", Base::GetDefaultFormat()));
+        }
+
+        if constexpr (STYLE != 0)
+        {
+            using Expansion = StaticJSONStyleExpansion<STYLE>;
+            return Serializer<JSONFormat, Expansion>(Expansion{},
+                                                     REVERSE_MULTIMAPS,
+                                                     ELIDE_LIMIT,
+                                                     THREADS,
+                                                     KEY_CACHE,
+                                                     RECORD_LAYOUT)
+                .write(out, val, INDENT, DISABLE_BRAS);
+        }
+        else
+        {
+            return Serializer<JSONFormat>(JSONStyleExpansion::Get(Base::GetDefaultJSONStyle().value),
+                                          REVERSE_MULTIMAPS,
+                                          ELIDE_LIMIT,
+                                          THREADS,
+                                          KEY_CACHE,
+                                          RECORD_LAYOUT)
+                .write(out, val, INDENT, DISABLE_BRAS);
+        }
+    }
+}; // struct CompiledFormatter
+
+} // namespace internal
+
+//
+// Create a format string which is parsed at compile time, for use with
+// fmtster::format() and fmtster::format_to() (similar to FMT_COMPILE()), e.g.
+//     fmtster::format(FMTSTER_COMPILE("{:2,-b,,json}"), container)
+// The string must hold one replacement field without nested arguments, and
+// may not change the defaults (i.e. no 'f' or 's' per call parms) or refer
+// to a style by name.
+//
+#define FMTSTER_COMPILE(s)                                                     \
+    [] {                                                                       \
+        struct FmtsterCompiledString                                           \
+          : fmtster::internal::CompiledString                                  \
+        {                                                                      \
+            static constexpr std::string_view value()                          \
+            {                                                                  \
+                return s;                                                      \
+            }                                                                  \
+        };                                                                     \
+        return FmtsterCompiledString{};                                        \
+    }()
+
+#if defined(__cpp_nontype_template_args) && (__cpp_nontype_template_args >= 201911L)
+
+namespace internal
+{
+
+// String literal holder usable as a template argument
+template<size_t N>
+struct FixedString
+{
+    char mStr[N] = {};
+
+    constexpr FixedString(const char (&str)[N])
+    {
+        for (size_t i = 0; i < N; i++)
+            mStr[i] = str[i];
+    }
+};
+
+} // namespace internal
+
+//
+// C++20 spelling of FMTSTER_COMPILE(), e.g.
+//     fmtster::format(fmtster::compiled<"{:2,-b,,json}">{}, container)
+//
+template<internal::FixedString S>
+struct compiled
+  : internal::CompiledString
+{
+    static constexpr std::string_view value()
+    {
+        return std::string_view(S.mStr, sizeof(S.mStr) - 1);
+    }
+};
+
+#endif // __cpp_nontype_template_args
+
+//
+// Serialize the value as specified by a compiled format string
+//
+template<typename S,
+         typename OutputIt,
+         typename T,
+         typename = enable_if_t<std::is_base_of_v<internal::CompiledString, S> > >
+OutputIt format_to(OutputIt out, S, const T& val)
+{
+    constexpr internal::CompiledSpec spec = internal::ParseCompiledSpec(S::value());
+
+    out = internal::put(out, spec.prefix);
+    out = internal::CompiledFormatter<spec.indent,
+                                      spec.disableBras,
+                                      spec.reverseMultimaps,
+                                      spec.elideLimit,
+                                      spec.threads,
+                                      spec.keyCache,
+                                      spec.recordLayout,
+                                      spec.style,
+                                      spec.format>::format_to(out, val);
+    return internal::put(out, spec.suffix);
+}
+
+template<typename S,
+         typename T,
+         typename = enable_if_t<std::is_base_of_v<internal::CompiledString, S> > >
+string format(S s, const T& val)
+{
+    string str;
+    fmtster::format_to(std::back_inserter(str), s, val);
+    return str;
+}
+
+//
+// Serialize the value with a style known at compile time (see
+// fmtster::JSONStyleValue()), whose newline and indents are constants
+//
+template<internal::VALUE_T STYLE, typename OutputIt, typename T>
+OutputIt format_to(OutputIt out, const T& val, size_t indent = 0)
+{
+    using Expansion = internal::StaticJSONStyleExpansion<STYLE>;
+    return internal::Serializer<internal::JSONFormat, Expansion>(Expansion{})
+        .write(out, val, indent, false);
+}
+
+template<internal::VALUE_T STYLE, typename T>
+string format(const T& val, size_t indent = 0)
+{
+    string str;
+    fmtster::format_to<STYLE>(std::back_inserter(str), val, indent);
+    return str;
+}
+
+//
+// Exact length of the serialization of the value (as by "{:indent,,style}"),
+// computed with the same style and escaping rules but without writing it,
+// e.g. to size a network frame or log slot ahead of serializing into it
+//
+template<typename T>
+size_t serialized_size(const T& val,
+                       const JSONStyle& style = Base::GetDefaultJSONStyle(),
+                       size_t indent = 0)
+{
+    const auto& expansion = internal::JSONStyleExpansion::Get(style.value);
+    return internal::Serializer<internal::JSONFormat>(expansion)
+        .write(internal::CountingIterator(), val, indent, false)
+        .count();
+}
+
+//
+// Serialize the value in two passes: the first measures its exact length and
+// the second fills a string allocated once at that size (rather than growing
+// it as it is written)
+//
+template<typename T>
+string format_exact(const T& val,
+                    const JSONStyle& style = Base::GetDefaultJSONStyle(),
+                    size_t indent = 0)
+{
+    const auto& expansion = internal::JSONStyleExpansion::Get(style.value);
+    const internal::Serializer<internal::JSONFormat> serializer(expansion);
+
+    string str(serializer.write(internal::CountingIterator(), val, indent, false).count(),
+               '\0');
+    serializer.write(str.data(), val, indent, false);
+    return str;
+}
+
+#if __has_include(<memory_resource>)
+//
+// Serialize into a std::pmr::string allocated from the resource (e.g. a
+// per-request std::pmr::monotonic_buffer_resource), so that the whole result
+// is released with it. Serialization itself allocates nothing from the global
+// heap, except to expand a style on its first use, to fill the KeyCache of the
+// 'k' per call parm, for the chunks of the 'p' per call parm and for the
+// caches of fmtster::Cached<> values.
+//
+// (the format string is checked when formatted, like that of F(), since the
+// fmtster formatters cannot be parsed at compile time)
+template<typename... Args>
+std::pmr::string format(std::pmr::memory_resource* pResource,
+                        std::string_view fmtStr,
+                        const Args&... args)
+{
+    std::pmr::string str(pResource);
+    fmt::format_to(std::back_inserter(str), fmt::runtime(fmtStr), args...);
+    return str;
+}
+
+template<typename S,
+         typename T,
+         typename = enable_if_t<std::is_base_of_v<internal::CompiledString, S> > >
+std::pmr::string format(std::pmr::memory_resource* pResource, S s, const T& val)
+{
+    std::pmr::string str(pResource);
+    fmtster::format_to(std::back_inserter(str), s, val);
+    return str;
+}
+
+// (allocated from the resource once, at the exact size, which suits a
+// monotonic resource best)
+template<typename T>
+std::pmr::string format_exact(std::pmr::memory_resource* pResource,
+                              const T& val,
+                              const JSONStyle& style = Base::GetDefaultJSONStyle(),
+                              size_t indent = 0)
+{
+    const auto& expansion = internal::JSONStyleExpansion::Get(style.value);
+    const internal::Serializer<internal::JSONFormat> serializer(expansion);
+
+    std::pmr::string str(serializer.write(internal::CountingIterator(), val, indent, false).count(),
+                         '\0',
+                         pResource);
+    serializer.write(str.data(), val, indent, false);
+    return str;
+}
+#endif // __has_include(<memory_resource>)
+
+//
+// Result of fmtster::format_to_n()
+//
+template<typename OutputIt>
+struct format_to_n_result
+{
+    OutputIt out;       // end of the output
+    size_t size;        // number of chars written
+    bool truncated;     // whether the budget ran out before the end
+    size_t omitted;     // number of container elements never reached
+};
+
+//
+// Serialize the value as specified by a (run-time) format string holding a
+// single fmtster replacement field, writing at most n chars. Once the budget
+// is exhausted the traversal stops, so the work done is bounded by n rather
+// than by the size of the value. The elements which were never reached (i.e.
+// after the one in progress, in each container left open) are reported as
+// omitted. When closeBrackets is set, the output is cut back to the end of the
+// last complete element which leaves room to close the open brackets/braces,
+// so it remains valid JSON; otherwise it is simply the first n chars.
+// As with compiled format strings, the style must be a literal value, and a
+// nested custom fmtster formatter is serialized in full before being cut.
+//
+template<typename OutputIt, typename T>
+format_to_n_result<OutputIt> format_to_n(OutputIt out,
+                                         size_t n,
+                                         std::string_view fmtStr,
+                                         const T& val,
+                                         bool closeBrackets = false)
+{
+    const internal::CompiledSpec spec = internal::ParseCompiledSpec(fmtStr);
+    if ((spec.format < 0) && (Base::GetDefaultFormat() != internal::JSONFormat::INDEX))
+        throw fmt::format_error(F("fmtster: unsupported format: {}", Base::GetDefaultFormat()));
+
+    const auto style = spec.style ? spec.style : Base::GetDefaultJSONStyle().value;
+    const internal::Serializer<internal::JSONFormat> serializer(internal::JSONStyleExpansion::Get(style),
+                                                                spec.reverseMultimaps,
+                                                                spec.elideLimit,
+                                                                1,
+                                                                spec.keyCache,
+                                                                spec.recordLayout);
+
+    internal::Budget budget(n, closeBrackets);
+    internal::SinkIterator<internal::Budget> it(budget);
+    it = internal::put(it, spec.prefix);
+    if (budget.commit())
+    {
+        it = serializer.write(it, val, spec.indent, spec.disableBras);
+        if (budget.commit())
+            internal::put(it, spec.suffix);
+    }
+
+    auto& str = budget.mBuffer;
+    if (budget.mExhausted && closeBrackets)
+    {
+        str.resize(budget.mCommitSize);
+        serializer.closeLevels(std::back_inserter(str), budget.mCommitLevels);
+    }
+
+    return { std::copy(str.begin(), str.end(), out),
+             str.size(),
+             budget.mExhausted,
+             budget.mOmitted };
+}
+
+template<typename OutputIt,
+         typename S,
+         typename T,
+         typename = enable_if_t<std::is_base_of_v<internal::CompiledString, S> > >
+format_to_n_result<OutputIt> format_to_n(OutputIt out,
+                                         size_t n,
+                                         S,
+                                         const T& val,
+                                         bool closeBrackets = false)
+{
+    return fmtster::format_to_n(out, n, S::value(), val, closeBrackets);
+}
+
+namespace internal
+{
+
+//
+// Writers of a full sink buffer to its destination, which throw on failure
+//
+#if __has_include(<unistd.h>)
+struct FdWriter
+{
+    int mFd;
+
+    void operator()(const char* p, size_t size) const
+    {
+        while (size)
+        {
+            const auto written = ::write(mFd, p, size);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw fmt::system_error(errno, "fmtster: cannot write to fd {}", mFd);
+            }
+            p += written;
+            size -= written;
+        }
+    }
+};
+#endif // __has_include(<unistd.h>)
+
+struct FileWriter
+{
+    std::FILE* mpFile;
 
-        } /// for(const auto c : pcpSetting)
+    void operator()(const char* p, size_t size) const
+    {
+        if (std::fwrite(p, 1, size, mpFile) != size)
+            throw fmt::system_error(errno, "fmtster: cannot write to FILE");
+    }
+};
 
-    } // resolveArgs()
+struct StreambufWriter
+{
+    std::streambuf* mpStreambuf;
 
-}; // struct FmtterBase
+    void operator()(const char* p, size_t size) const
+    {
+        if (mpStreambuf->sputn(p, size) != std::streamsize(size))
+            throw fmt::format_error("fmtster: cannot write to streambuf");
+    }
+};
 
-} // namespace fmtster
+} // namespace internal
 
 //
-// fmt::formatter<> used for all containers (not adapters)
+// Destination which is serialized into through a fixed-size buffer, which is
+// passed to WRITER (called as writer(const char* p, size_t size)) each time it
+// fills, so the memory used does not depend on the size of the output. The
+// remainder is written by flush(), or on destruction (where write errors are
+// ignored, so call flush() to see them).
 //
-template<typename T, typename Char>
-struct fmt::formatter<T,
-                      Char,
-                      std::enable_if_t<fmtster::internal::is_container_v<T> > >
-  : fmtster::Base
+template<typename WRITER, size_t SIZE = 16 * 1024>
+class BufferedSink
 {
-    template<typename FormatContext>
-    using FCIt_t = decltype(std::declval<FormatContext>().out());
-
-    //
-    // Templated function inner loop for ALL CONTAINERS EXCEPT MULTIMAPS
-    // (This is able to be used for single data per element & map-like
-    // containers, because map-like containers use a std::pair<> for each
-    // element.)
-    //
-    template<typename FormatContext, typename C = T>
-    std::enable_if_t<std::negation_v<fmtster::internal::is_multimappish<C> > >
-        format_loop(const C& c, FCIt_t<FormatContext>& itFC) const
-    {
-        using namespace fmtster::internal;
-
-        auto& d = *mpData;
+    static_assert(SIZE > 0, "fmtster: a sink buffer must not be empty");
 
-        auto itC = c.begin();
-        while (itC != c.end())
-        {
-            const auto indent = d.mDisableBras ? d.mBraIndent : d.mDataIndent;
+    WRITER mWriter;
+    size_t mUsed = 0;
+    std::array<char, SIZE> mBuffer;
 
-            std::string fmtStr;
+public:
+    using iterator = internal::SinkIterator<BufferedSink>;
 
-            bool isFirstElement = (itC == c.begin());
-            bool newLine = !d.mDisableBras || !isFirstElement;
-            if (newLine)
-                fmtStr = d.mpStyleHelper->mNewline;
+    template<typename... Args>
+    explicit BufferedSink(Args&&... args)
+      : mWriter{ std::forward<Args>(args)... }
+    {}
 
-            // get current element value
-            const auto& val = *itC;
+    BufferedSink(const BufferedSink&) = delete;
+    BufferedSink& operator=(const BufferedSink&) = delete;
 
-            // this is done ahead to determine comma insertion
-            itC++;
+    ~BufferedSink()
+    {
+        try
+        {
+            flush();
+        }
+        catch (...)
+        {}
+    }
 
-            bool isLastElement = (itC == c.end());
+    // output iterator for fmtster or {fmt} (e.g. fmt::format_to(sink.out(), ...))
+    iterator out() { return iterator(*this); }
 
-            using SimpleValType = simplify_type<decltype(val)>;
+    void push_back(char c)
+    {
+        if (mUsed == SIZE)
+            flush();
+        mBuffer[mUsed++] = c;
+    }
 
-            auto escVal = escapeIfString(d.mFormatSetting, val);
+    void append(const char* p, size_t size)
+    {
+        if (size > SIZE - mUsed)
+        {
+            flush();
 
-            if (is_fmtsterable_v<SimpleValType>)
+            // too large to buffer, so written directly
+            if (size >= SIZE)
             {
-                if (!is_pair_v<SimpleValType>)
-                    fmtStr += indent;
-
-                fmtStr += isLastElement ? "{:{},{},{},{}}" : "{:{},{},{},{}},";
-                auto pcp = is_pair_v<simplify_type<decltype(val)> > ? "-b" : "";
-                itFC = fmt::format_to(itFC,
-                                      fmtStr,
-                                      escVal,
-                                      d.mIndentSetting,
-                                      pcp,
-                                      d.mStyleValue,
-                                      d.mFormatSetting);
+                mWriter(p, size);
+                return;
             }
-            else
-            {
-                fmtStr += indent;
+        }
+        std::memcpy(mBuffer.data() + mUsed, p, size);
+        mUsed += size;
+    }
 
-                if (fmtster::internal::is_string_v<decltype(val)>)
-                    fmtStr += isLastElement ? "\"{}\"" : "\"{}\",";
-                else
-                    fmtStr += isLastElement ? "{}" : "{},";
-                itFC = fmt::format_to(itFC,
-                                      fmtStr,
-                                      escVal);
-            }
+    void flush()
+    {
+        if (mUsed)
+        {
+            // (emptied first, so a failed write is not repeated)
+            const auto used = mUsed;
+            mUsed = 0;
+            mWriter(mBuffer.data(), used);
         }
-    } // format_loop() (all containers except multimap)
+    }
+}; // class BufferedSink
 
-    //
-    // Templated function inner loop for MULTIMAPS
-    //
-    template<typename FormatContext, typename C = T>
-    std::enable_if_t<fmtster::internal::is_multimappish_v<C> >
-        format_loop(const C& c, FCIt_t<FormatContext>& itFC) const
+#if __has_include(<unistd.h>)
+using FdSink = BufferedSink<internal::FdWriter>;
+#endif // __has_include(<unistd.h>)
+using FileSink = BufferedSink<internal::FileWriter>;
+using StreambufSink = BufferedSink<internal::StreambufWriter>;
+
+#if __has_include(<sys/mman.h>) && __has_include(<unistd.h>)
+//
+// File (created or truncated) which is serialized into through a shared memory
+// mapping of it, so the output is neither built in memory nor copied by
+// write(). The file is extended by at least step bytes at a time (more as it
+// grows), optionally with transparent huge pages, and is trimmed to the size
+// of the output by close(), or on destruction (where errors are ignored, so
+// call close() to see them).
+//
+class MappedFileSink
+{
+    int mFd;
+    char* mpData = nullptr;
+    size_t mSize = 0;
+    size_t mCapacity = 0;
+    const size_t mStep;
+    const bool mHugePages;
+
+    // (kept out of push_back() and append(), which are called for every write)
+    void grow(size_t size)
     {
-        using namespace fmtster::internal;
+        if (mFd < 0)
+            throw fmt::system_error(EBADF, "fmtster: mapped file is closed");
 
-        auto& d = *mpData;
+        const size_t pageSize = size_t(::sysconf(_SC_PAGESIZE));
+        size_t capacity = std::max(mCapacity + std::max(mStep, mCapacity), size);
+        capacity = ((capacity + pageSize - 1) / pageSize) * pageSize;
 
-        auto itC = c.begin();
-        while (itC != c.end())
+        if (::ftruncate(mFd, off_t(capacity)) != 0)
+            throw fmt::system_error(errno, "fmtster: cannot extend mapped file to {} bytes", capacity);
+
+        void* p;
+        if (mpData)
+        {
+#ifdef MREMAP_MAYMOVE
+            p = ::mremap(mpData, mCapacity, capacity, MREMAP_MAYMOVE);
+#else
+            // (if mapping again fails, the next write maps the file anew, as
+            // the output so far is in the file)
+            ::munmap(mpData, mCapacity);
+            mpData = nullptr;
+            mCapacity = 0;
+            p = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+#endif // MREMAP_MAYMOVE
+        }
+        else
         {
-            const auto indent = d.mDisableBras ? d.mBraIndent : d.mDataIndent;
+            p = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+        }
+        if (p == MAP_FAILED)
+            throw fmt::system_error(errno, "fmtster: cannot map file ({} bytes)", capacity);
 
-            std::string fmtStr;
+#ifdef MADV_HUGEPAGE
+        // (only advice, which not all file systems take)
+        if (mHugePages)
+            ::madvise(p, capacity, MADV_HUGEPAGE);
+#endif // MADV_HUGEPAGE
 
-            bool isFirstElement = (itC == c.begin());
-            bool newLine = !d.mDisableBras || !isFirstElement;
-            if (newLine)
-                fmtStr = d.mpStyleHelper->mNewline;
+        mpData = static_cast<char*>(p);
+        mCapacity = capacity;
+    } // grow()
 
-            // output the key
-            const auto& key = itC->first;
-            if (fmtster::internal::is_string_v<decltype(key)>)
-                fmtStr += "{}\"{}\" : ";
-            else
-                fmtStr += "{}{} : ";
-            itFC = fmt::format_to(itFC,
-                                  fmtStr,
-                                  indent,
-                                  escapeIfString(d.mFormatSetting, key));
+public:
+    using iterator = internal::SinkIterator<MappedFileSink>;
+
+    explicit MappedFileSink(const std::string& path,
+                            size_t step = 64 * 1024 * 1024,
+                            bool hugePages = false)
+      : mFd(::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)),
+        mStep(std::max<size_t>(step, 1)),
+        mHugePages(hugePages)
+    {
+        if (mFd < 0)
+            throw fmt::system_error(errno, "fmtster: cannot open {}", path);
+    }
 
-            // insert each value with the same key into a temp vector to
-            // print
-            std::vector<typename C::mapped_type> vals;
-            do
-            {
-                vals.insert(vals.begin(), itC->second);
-                itC++;
-            } while ((itC != c.end()) && (itC->first == key));
+    MappedFileSink(const MappedFileSink&) = delete;
+    MappedFileSink& operator=(const MappedFileSink&) = delete;
 
-            fmtStr = (itC != c.end()) ? "{:{},{},{},{}}," : "{:{},{},{},{}}";
-            itFC = format_to(itFC,
-                            fmtStr,
-                            vals,
-                            d.mIndentSetting,
-                            "",
-                            d.mStyleValue,
-                            d.mFormatSetting);
+    ~MappedFileSink()
+    {
+        try
+        {
+            close();
         }
-    } // format_loop() (multimaps)
+        catch (...)
+        {}
+    }
+
+    // output iterator for fmtster or {fmt} (e.g. fmt::format_to(sink.out(), ...))
+    iterator out() { return iterator(*this); }
+
+    // number of chars written
+    size_t size() const { return mSize; }
+
+    // (the capacity is less than the size when unmapped)
+    void push_back(char c)
+    {
+        if (mSize >= mCapacity)
+            grow(mSize + 1);
+        mpData[mSize++] = c;
+    }
+
+    void append(const char* p, size_t size)
+    {
+        if (mSize + size > mCapacity)
+            grow(mSize + size);
+        std::memcpy(mpData + mSize, p, size);
+        mSize += size;
+    }
 
     //
-    // format()
+    // Unmap the file and trim it to the size of the output (writing to the
+    // sink after this throws)
     //
-    template<typename FormatContext>
-    auto format(const T& sc, FormatContext& ctx) const
+    void close()
     {
-        using fmt::format_to;
-        using namespace fmtster::internal;
+        if (mFd < 0)
+            return;
+
+        // (closed first, so a failure is not repeated)
+        const int fd = mFd;
+        mFd = -1;
+        if (mpData)
+            ::munmap(mpData, mCapacity);
+        mpData = nullptr;
+        mCapacity = 0;
+
+        const bool trimmed = (::ftruncate(fd, off_t(mSize)) == 0);
+        const int error = errno;
+        ::close(fd);
+        if (!trimmed)
+            throw fmt::system_error(error, "fmtster: cannot trim mapped file to {} bytes", mSize);
+    } // close()
+}; // class MappedFileSink
+#endif // __has_include(<sys/mman.h>) && __has_include(<unistd.h>)
 
-        auto& d = *mpData;
+//
+// Destination which gathers the output as a list of segments (e.g. for
+// writev()), instead of a single string. The brackets, gaps, other values and
+// escapes are copied into a buffer, but the runs of string values and keys
+// which need no escaping and are too long to be gathered by the escape (over
+// 128 chars) are only referenced in place. So the serialized values must
+// outlive the use of the segments, as must the sink, which must not be
+// written to meanwhile.
+//
+class GatherSink
+{
+    // (a referenced run, which follows the buffer up to mOffset)
+    struct Reference
+    {
+        size_t mOffset;
+        std::string_view mData;
+    };
 
-        resolveArgs(ctx);
+    string mBuffer;
+    std::vector<Reference> mReferences;
+    size_t mReferenced = 0;
 
-        auto itFC = ctx.out();
+public:
+    using iterator = internal::SinkIterator<GatherSink>;
 
-        // output opening bracket/brace (if enabled)
-        if (!d.mDisableBras)
-        {
-            itFC = format_to(itFC, is_braceable_v<T> ? "{{" : "[");
-            d.mIndentSetting++;
-        }
+    GatherSink() = default;
+    GatherSink(const GatherSink&) = delete;
+    GatherSink& operator=(const GatherSink&) = delete;
+
+    // output iterator for fmtster or {fmt} (e.g. fmt::format_to(sink.out(), ...))
+    iterator out() { return iterator(*this); }
+
+    // number of chars in the segments, and of those in the buffer
+    size_t size() const { return mBuffer.size() + mReferenced; }
+    size_t copied() const { return mBuffer.size(); }
+
+    void push_back(char c) { mBuffer.push_back(c); }
+    void append(const char* p, size_t size) { mBuffer.append(p, size); }
+    void reference(std::string_view sv)
+    {
+        mReferences.push_back({ mBuffer.size(), sv });
+        mReferenced += sv.size();
+    }
 
-        const bool empty = (sc.end() == sc.begin());
+    void clear()
+    {
+        mBuffer.clear();
+        mReferences.clear();
+        mReferenced = 0;
+    }
 
-        if (empty && !d.mDisableBras)
+    //
+    // Call fn(std::string_view) with each (non-empty) segment, in order
+    //
+    template<typename FN>
+    void segments(FN&& fn) const
+    {
+        const std::string_view buffer(mBuffer);
+        size_t offset = 0;
+        for (const auto& ref : mReferences)
         {
-            itFC = format_to(itFC, is_braceable_v<T> ? " }}" : " ]");
+            if (ref.mOffset > offset)
+                fn(buffer.substr(offset, ref.mOffset - offset));
+            offset = ref.mOffset;
+            fn(ref.mData);
         }
-        else
+        if (buffer.size() > offset)
+            fn(buffer.substr(offset));
+    }
+
+    string str() const
+    {
+        string joined;
+        joined.reserve(size());
+        segments([&joined](std::string_view sv) { joined.append(sv); });
+        return joined;
+    }
+
+#if __has_include(<sys/uio.h>)
+    std::vector<iovec> iovecs() const
+    {
+        std::vector<iovec> iov;
+        iov.reserve(2 * mReferences.size() + 1);
+        segments([&iov](std::string_view sv)
+                 {
+                     iov.push_back({ const_cast<char*>(sv.data()), sv.size() });
+                 });
+        return iov;
+    }
+
+#if __has_include(<unistd.h>)
+    //
+    // Write all the segments to the fd with writev(), as many at a time as it
+    // allows
+    //
+    void write(int fd) const
+    {
+        auto iov = iovecs();
+        const auto batch = std::max<long>(::sysconf(_SC_IOV_MAX), 1);
+
+        size_t i = 0;
+        while (i < iov.size())
         {
-            format_loop<FormatContext, T>(sc, itFC);
+            const auto count = int(std::min<size_t>(iov.size() - i, batch));
+            const auto written = ::writev(fd, iov.data() + i, count);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw fmt::system_error(errno, "fmtster: cannot write to fd {}", fd);
+            }
 
-            if (!d.mDisableBras)
+            // (skipping what was written, which may end within a segment)
+            for (size_t n = written; n; )
             {
-                // output closing brace
-                itFC = format_to(itFC,
-                                is_braceable_v<T> ? "{}{}}}" : "{}{}]",
-                                d.mpStyleHelper->mNewline,
-                                d.mBraIndent);
+                if (n >= iov[i].iov_len)
+                {
+                    n -= iov[i++].iov_len;
+                }
+                else
+                {
+                    iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + n;
+                    iov[i].iov_len -= n;
+                    n = 0;
+                }
             }
         }
+    } // write()
+#endif // __has_include(<unistd.h>)
+#endif // __has_include(<sys/uio.h>)
+}; // class GatherSink
 
-        return itFC;
+//
+// Serialize the value (as by "{:indent,,style}") straight into the sink (a
+// BufferedSink<>, MappedFileSink or GatherSink), without building a string
+//
+template<typename SINK,
+         typename T,
+         typename = decltype(std::declval<SINK&>().out())>
+void print(SINK& sink,
+           const T& val,
+           const JSONStyle& style = Base::GetDefaultJSONStyle(),
+           size_t indent = 0)
+{
+    const auto& expansion = internal::JSONStyleExpansion::Get(style.value);
+    internal::Serializer<internal::JSONFormat>(expansion)
+        .write(sink.out(), val, indent, false);
+}
 
-    } // format()
+// (through a sink which is flushed before returning)
+#if __has_include(<unistd.h>)
+template<typename T>
+void print(int fd,
+           const T& val,
+           const JSONStyle& style = Base::GetDefaultJSONStyle(),
+           size_t indent = 0)
+{
+    FdSink sink(fd);
+    fmtster::print(sink, val, style, indent);
+    sink.flush();
+}
+#endif // __has_include(<unistd.h>)
+
+template<typename T>
+void print(std::FILE* pFile,
+           const T& val,
+           const JSONStyle& style = Base::GetDefaultJSONStyle(),
+           size_t indent = 0)
+{
+    FileSink sink(pFile);
+    fmtster::print(sink, val, style, indent);
+    sink.flush();
+}
+
+template<typename T>
+void print(std::ostream& os,
+           const T& val,
+           const JSONStyle& style = Base::GetDefaultJSONStyle(),
+           size_t indent = 0)
+{
+    StreambufSink sink(os.rdbuf());
+    fmtster::print(sink, val, style, indent);
+    sink.flush();
+}
+
+} // namespace fmtster
 
+//
+// fmt::formatter<> used for all containers (not adapters)
+//
+template<typename T, typename Char>
+struct fmt::formatter<T,
+                      Char,
+                      std::enable_if_t<fmtster::internal::is_container_v<T> > >
+  : fmtster::Base
+{
+    template<typename FormatContext>
+    auto format(const T& sc, FormatContext& ctx) const
+    {
+        resolveArgs(ctx);
+        return serialize(ctx.out(), sc);
+    } // format()
 }; // struct fmt::formatter< containers >
 
 //
@@ -1223,39 +4882,31 @@ template<typename A, typename Char>
 struct fmt::formatter<A,
                       Char,
                       std::enable_if_t<fmtster::internal::is_adapter<A>::value> >
+  : fmtster::Base
 {
-    std::string mStrFmt;
-
-    template<typename ParseContext>
-    constexpr auto parse(ParseContext& ctx)
-    {
-        // get adapter format and forward to internal type
-        auto itCtxEnd = std::find(ctx.begin(), ctx.end(), '}');
-        mStrFmt = "{" + std::string(ctx.begin(), itCtxEnd) + "}";
-        return itCtxEnd;
-    } // parse()
-
-    template <class ADAPTER>
-    static typename ADAPTER::container_type const& GetAdapterContainer(ADAPTER &a)
-    {
-        struct hack : public ADAPTER
-        {
-            static typename ADAPTER::container_type const& Get(ADAPTER &a)
-            {
-                return a.*&hack::c;
-            }
-        };
-
-        return hack::Get(a);
-    } // GetAdapterContainer()
-
     template<typename FormatContext>
     auto format(const A& ac, FormatContext& ctx) const
     {
-        return fmt::format_to(ctx.out(), mStrFmt, GetAdapterContainer(ac));
-    }
+        resolveArgs(ctx);
+        return serialize(ctx.out(), fmtster::internal::GetAdapterContainer(ac));
+    } // format()
 }; // struct fmt::formatter< adapters >
 
+//
+// fmt::formatter<> for fmtster::Cached<>
+//
+template<typename T>
+struct fmt::formatter<fmtster::Cached<T> >
+  : fmtster::Base
+{
+    template<typename FormatContext>
+    auto format(const fmtster::Cached<T>& cached, FormatContext& ctx) const
+    {
+        resolveArgs(ctx);
+        return serialize(ctx.out(), cached);
+    } // format()
+}; // struct fmt::formatter<fmtster::Cached<> >
+
 //
 // fmt::formatter<> for std::pair<>
 //
@@ -1266,61 +4917,8 @@ struct fmt::formatter<std::pair<T1, T2> >
     template<typename FormatContext>
     auto format(const std::pair<T1, T2>& p, FormatContext& ctx) const
     {
-        using fmt::format_to;
-        using namespace fmtster::internal;
-
-        auto& d = *mpData;
-
         resolveArgs(ctx);
-
-        auto itFC = ctx.out();
-
-        // output opening bracket/brace (if enabled)
-        if (!d.mDisableBras)
-        {
-            itFC = format_to(itFC, "{{{}", d.mpStyleHelper->mNewline);
-            d.mIndentSetting++;
-        }
-
-        // WARNING: a pair that doesn't have a string first is not JSON compliant
-
-        // key
-        std::string fmtStr = fmtster::internal::is_string_v<T1>
-                            ? "{}\"{}\" : "
-                            : "{}{} : ";
-        itFC = format_to(ctx.out(),
-                        fmtStr,
-                        d.mDisableBras ? d.mBraIndent : d.mDataIndent,
-                        escapeIfString(d.mFormatSetting, p.first));
-
-        // value
-        if (fmtster::internal::is_fmtsterable_v<T2>)
-        {
-            itFC = format_to(itFC,
-                            "{:{},{},{},{}}",
-                            p.second,
-                            d.mIndentSetting,
-                            "",
-                            d.mStyleValue,
-                            d.mFormatSetting);
-        }
-        else
-        {
-            fmtStr = fmtster::internal::is_string_v<T2>
-                    ? "\"{}\""
-                    : fmtStr = "{}";
-            itFC = format_to(itFC,
-                            fmtStr,
-                            escapeIfString(d.mFormatSetting, p.second));
-        }
-
-        // output closing bracket/brace (if enabled)
-        if (!d.mDisableBras)
-        {
-            itFC = format_to(itFC, "{}{}}}", d.mpStyleHelper->mNewline, d.mBraIndent);
-        }
-
-        return itFC;
+        return serialize(ctx.out(), p);
     } // format()
 }; // struct fmt::formatter<std::pair<> >
 
@@ -1335,79 +4933,8 @@ struct fmt::formatter<std::tuple<Ts...> >
     template<typename FormatContext>
     auto format(const std::tuple<Ts...>& tup, FormatContext& ctx) const
     {
-        using fmt::format_to;
-        using namespace fmtster::internal;
-
-        auto& d = *mpData;
-
         resolveArgs(ctx);
-
-        auto itFC = ctx.out();
-
-        const auto indent = d.mDisableBras ? d.mBraIndent : d.mDataIndent;
-
-        // output opening brace (if enabled)
-        if (!d.mDisableBras)
-        {
-            itFC = format_to(itFC, "{{");
-            d.mIndentSetting++;
-        }
-
-        // get number of items in the tuple
-        auto count = sizeof...(Ts);
-
-        const bool empty = !count;
-
-        if (empty && !d.mDisableBras)
-        {
-            // output space & closing brace at the same time
-            itFC = format_to(itFC, " }}");
-        }
-        else
-        {
-            auto fn =
-                [&](const auto& elem)
-                {
-                    std::string fmtStr;
-                    if (!d.mDisableBras || (count != sizeof...(Ts)))
-                        fmtStr = d.mpStyleHelper->mNewline;
-
-                    if (fmtster::internal::is_fmtsterable_v<decltype(elem)>)
-                    {
-                        fmtStr += (--count) ? "{:{},{},{},{}}," : "{:{},{},{},{}}";
-                        auto pcp = is_pair_v<simplify_type<decltype(elem)> > ? "-b" : "";
-                        itFC = format_to(itFC,
-                                         fmtStr,
-                                         elem,
-                                         d.mIndentSetting,
-                                         pcp,
-                                         d.mStyleValue,
-                                         d.mFormatSetting);
-                    }
-                    else
-                    {
-                        fmtStr += indent;
-
-                        if (fmtster::internal::is_string_v<decltype(elem)>)
-                            fmtStr += (--count) ? "\"{}\"," : "\"{}\"";
-                        else
-                            fmtStr += (--count) ? "{}," : "{}";
-
-                        itFC = format_to(itFC,
-                                         fmtStr,
-                                         escapeIfString(d.mFormatSetting, elem));
-                    }
-                };
-            std::apply([&](const auto&... elems){(fn(elems), ...);}, tup);
-
-            // output closing brace (if enabled)
-            if (!d.mDisableBras)
-            {
-                itFC = format_to(itFC, "{}{}}}", d.mpStyleHelper->mNewline, d.mBraIndent);
-            }
-        }
-
-        return itFC;
+        return serialize(ctx.out(), tup);
     } // format()
 }; // struct fmt::formatter<std::tuple<> >
 
@@ -1423,21 +4950,15 @@ struct fmt::formatter<fmtster::JSONStyle>
     {
         using std::make_pair;
 
-        auto& d = *mpData;
-
         resolveArgs(ctx);
 
-        auto itFC = ctx.out();
-
         const auto tup = std::make_tuple(
             make_pair("value", style.value),
             make_pair("cr", style.cr),
             make_pair("lf", style.lf),
             make_pair("hardTab", style.hardTab),
-            make_pair("tabCount", style.tabCount)
-
-#if false // @@@ TODO
-            ,
+            make_pair("tabCount", style.tabCount),
+            make_pair("utf8", style.utf8),
             make_pair("gapA", style.gapA),
             make_pair("gapB", style.gapB),
             make_pair("gapC", style.gapC),
@@ -1452,20 +4973,8 @@ struct fmt::formatter<fmtster::JSONStyle>
             make_pair("emptyObject", style.emptyObject),
             make_pair("singleLineArray", style.singleLineArray),
             make_pair("singleLineObject", style.singleLineObject)
-
-#endif // false
-
         );
-        auto pcp = d.mDisableBras ? "-b" : "";
-        itFC = fmt::format_to(itFC,
-                            "{:{},{},{},{}}",
-                            tup,
-                            d.mIndentSetting,
-                            pcp,
-                            d.mStyleValue,
-                            d.mFormatSetting);
-
-        return itFC;
+        return serialize(ctx.out(), tup);
     } // format()
 };
 
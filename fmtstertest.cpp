@@ -90,6 +90,90 @@ using std::declval;
 using std::pair;
 using std::make_pair;
 
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory_resource>
+#include <new>
+#include <optional>
+#include <sstream>
+#include <system_error>
+#include <thread>
+
+/* allocation counting (used to verify that serialization does not copy) */
+std::atomic<size_t> gAllocations{ 0 };
+
+// (the replacements which call malloc() and free() are not inlined, or GCC
+// pairs those calls with the new and delete around them and reports them as
+// mismatched)
+[[gnu::noinline]] void* operator new(std::size_t size)
+{
+    gAllocations++;
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void* operator new[](std::size_t size)
+{
+    return ::operator new(size);
+}
+[[gnu::noinline]] void* operator new(std::size_t size, std::align_val_t align)
+{
+    gAllocations++;
+    const auto alignment = std::max(static_cast<std::size_t>(align), sizeof(void*));
+    if (void* p = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment))
+        return p;
+    throw std::bad_alloc();
+}
+void* operator new[](std::size_t size, std::align_val_t align)
+{
+    return ::operator new(size, align);
+}
+[[gnu::noinline]] void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+void operator delete(void* p, std::size_t) noexcept
+{
+    ::operator delete(p);
+}
+void operator delete[](void* p) noexcept
+{
+    ::operator delete(p);
+}
+void operator delete[](void* p, std::size_t) noexcept
+{
+    ::operator delete(p);
+}
+[[gnu::noinline]] void operator delete(void* p, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+void operator delete(void* p, std::size_t, std::align_val_t align) noexcept
+{
+    ::operator delete(p, align);
+}
+void operator delete[](void* p, std::align_val_t align) noexcept
+{
+    ::operator delete(p, align);
+}
+void operator delete[](void* p, std::size_t, std::align_val_t align) noexcept
+{
+    ::operator delete(p, align);
+}
+
+// number of heap allocations made while serializing data into a string with
+// enough reserved space to avoid growing
+template<typename T>
+size_t CountAllocations(const T& data, const char* fmtStr = "{}")
+{
+    string str;
+    str.reserve(1 << 16);
+    const size_t before = gAllocations;
+    fmt::format_to(std::back_inserter(str), fmt::runtime(fmtStr), data);
+    return gAllocations - before;
+}
+
 /* test data */
 template<typename T>
 vector<T> GetValueContainerData();
@@ -572,10 +656,8 @@ string RefDump(const fmtster::JSONStyle& style, string tab = "style")
           "{}\"cr\" : {},\n"
           "{}\"lf\" : {},\n"
           "{}\"hardTab\" : {},\n"
-          "{}\"tabCount\" : {}"
-                             "\n"
-#if false
-                             ",\n"
+          "{}\"tabCount\" : {},\n"
+          "{}\"utf8\" : {},\n"
           "{}\"gapA\" : {},\n"
           "{}\"gapB\" : {},\n"
           "{}\"gapC\" : {},\n"
@@ -590,15 +672,13 @@ string RefDump(const fmtster::JSONStyle& style, string tab = "style")
           "{}\"emptyObject\" : {},\n"
           "{}\"singleLineArray\" : {},\n"
           "{}\"singleLineObject\" : {}\n"
-#endif // false
           "}}",
       tab, style.value,
       tab, style.cr,
       tab, style.lf,
       tab, style.hardTab,
-      tab, style.tabCount
-#if false
-      ,
+      tab, style.tabCount,
+      tab, style.utf8,
       tab, style.gapA,
       tab, style.gapB,
       tab, style.gapC,
@@ -613,7 +693,6 @@ string RefDump(const fmtster::JSONStyle& style, string tab = "style")
       tab, style.emptyObject,
       tab, style.singleLineArray,
       tab, style.singleLineObject
-#endif // false
       );
 }
 
@@ -1183,3 +1262,1264 @@ TEST_F(FmtsterTest, Layers)
     EXPECT_EQ("  \"mm1\" : [\n    {\n      \"seven\" : 7,\n      \"six\" : 6\n    },\n    {\n      \"one\" : 1,\n      \"three\" : 3,\n      \"two\" : 2\n    }\n  ],\n  \"mm2\" : [\n    {\n      \"five\" : 5,\n      \"four\" : 4\n    }\n  ]",
               str);
 }
+
+TEST_F(FmtsterTest, map_of_vectors_of_maps_to_JSON)
+{
+    map<string, vector<map<string, int> > > telemetry =
+    {
+        { "cpu", { { { "core0", 10 }, { "core1", 20 } }, {} } },
+        { "mem", {} }
+    };
+    const string ref =
+        "{\n"
+        "  \"cpu\" : [\n"
+        "    {\n"
+        "      \"core0\" : 10,\n"
+        "      \"core1\" : 20\n"
+        "    },\n"
+        "    { }\n"
+        "  ],\n"
+        "  \"mem\" : [ ]\n"
+        "}";
+    string str = F("{}", telemetry);
+cout << str << endl;
+    EXPECT_EQ(ref, str);
+
+    str = F("{:1,-b}", telemetry);
+    EXPECT_EQ("  \"cpu\" : [\n"
+              "    {\n"
+              "      \"core0\" : 10,\n"
+              "      \"core1\" : 20\n"
+              "    },\n"
+              "    { }\n"
+              "  ],\n"
+              "  \"mem\" : [ ]",
+              str);
+}
+
+TEST_F(FmtsterTest, NestedAdapters)
+{
+    stack<int> s;
+    s.push(1);
+    s.push(2);
+    vector<stack<int> > vs = { s, stack<int>{} };
+    string str = F("{}", vs);
+    EXPECT_EQ("[\n  [\n    1,\n    2\n  ],\n  [ ]\n]", str);
+}
+
+TEST_F(FmtsterTest, TopLevelAdapters)
+{
+    stack<int> s;
+    s.push(1);
+    s.push(2);
+    queue<string> q;
+    q.push("a");
+    priority_queue<int> pq;
+    pq.push(3);
+    const auto& sc = fmtster::internal::GetAdapterContainer(s);
+    const auto& qc = fmtster::internal::GetAdapterContainer(q);
+    const auto& pqc = fmtster::internal::GetAdapterContainer(pq);
+
+    EXPECT_EQ("[\n  1,\n  2\n]", F("{}", s));
+    EXPECT_EQ(F("{:1}", sc), F("{:1}", s));
+    EXPECT_EQ(F("{:,-b}", sc), F("{:,-b}", s));
+    EXPECT_EQ(F("{:2,-b,2}", sc), F("{:2,-b,2}", s));
+    EXPECT_EQ(F("{:{},{},{}}", qc, 1, "-b", 2), F("{:{},{},{}}", q, 1, "-b", 2));
+    EXPECT_EQ(F("{:,e1}", pqc), F("{:,e1}", pq));
+    EXPECT_EQ(F("{:1}", deque<int>{}), F("{:1}", stack<int>{}));
+
+    // parsed without allocating, like the container formatters
+    const size_t before = gAllocations;
+    {
+        fmt::formatter<stack<int> > formatter;
+        fmt::format_parse_context ctx("1,-b,{},j}");
+        formatter.parse(ctx);
+    }
+    EXPECT_EQ(before, gAllocations);
+}
+
+TEST_F(FmtsterTest, NoElementCopies)
+{
+    // too long for the small string optimization & contains escaped chars
+    const string longStr = R"("a long string value\with some "escaped" chars")";
+    const vector<vector<string> > small(1, vector<string>(1, longStr));
+    const vector<vector<string> > large(16, vector<string>(16, longStr));
+    EXPECT_EQ(CountAllocations(small), CountAllocations(large));
+}
+
+TEST_F(FmtsterTest, NoAllocationsToBuildAndParse)
+{
+    const size_t before = gAllocations;
+    {
+        fmt::formatter<map<string, vector<int> > > formatter;
+        fmt::format_parse_context ctx("1,-b,{},j}");
+        formatter.parse(ctx);
+    }
+    EXPECT_EQ(before, gAllocations);
+
+    const map<string, vector<map<string, int> > > data =
+        { { "cpu", { { { "core0", 10 }, { "core1", 20 } } } } };
+    EXPECT_EQ(0, CountAllocations(data));
+    EXPECT_EQ(0, CountAllocations(data, "{:1,-b,,j}"));
+}
+
+TEST_F(FmtsterTest, NestedPerCallParms)
+{
+    EXPECT_EQ("\"key\" : \"value\"", F("{:,{}}", make_pair("key", "value"), "-b"));
+    EXPECT_EQ("\"key\" : \"value\"", F("{:,{}}", make_pair("key", "value"), "-b"s));
+}
+
+TEST_F(FmtsterTest, JSONStyle_InternedExpansions)
+{
+    fmtster::JSONStyle style;
+    style.tabCount = 4;
+    const auto& expansion = fmtster::internal::JSONStyleExpansion::Get(style.value);
+    EXPECT_EQ(&expansion, &fmtster::internal::JSONStyleExpansion::Get(style.value));
+    EXPECT_EQ("        ", expansion.indent(2));
+    EXPECT_EQ("    ", expansion.mTab);
+    EXPECT_EQ("\n", expansion.mNewline);
+}
+
+TEST_F(FmtsterTest, JSONStyle_Named)
+{
+    fmtster::JSONStyle style;
+    style.tabCount = 4;
+    fmtster::RegisterJSONStyle("fourspace", style);
+    map<string, int> msi = { { "one", 1 }, { "two" , 2 } };
+    const string ref = "{\n    \"one\" : 1,\n    \"two\" : 2\n}";
+    EXPECT_EQ(ref, F("{:,,@fourspace}", msi));
+    EXPECT_EQ(ref, F("{:,,@fourspace,j}", msi));
+    EXPECT_EQ(ref, F("{:,,{}}", msi, "@fourspace"));
+    EXPECT_EQ(ref, F("{:,,{}}", msi, "@fourspace"s));
+    ASSERT_THROW(F("{:,,@unknown}", msi), fmt::format_error);
+}
+
+TEST_F(FmtsterTest, DeepIndent)
+{
+    // deeper than the precomputed indents
+    const string str = F("{:40}", vector<int>{ 1 });
+    EXPECT_EQ("[\n" + string(41 * 2, ' ') + "1\n" + string(40 * 2, ' ') + "]", str);
+    EXPECT_EQ(string(40 * 2, ' ') + "\"key\" : 1", F("{:40,-b}", make_pair("key", 1)));
+}
+
+TEST_F(FmtsterTest, CompileTimeFormatPolicy)
+{
+    // no virtual dispatch (or RTTI lookups) are involved in serialization
+    EXPECT_FALSE(std::is_polymorphic_v<fmtster::internal::StyleHelper>);
+    EXPECT_FALSE(std::is_polymorphic_v<fmtster::internal::JSONStyleHelper>);
+    EXPECT_FALSE(std::is_polymorphic_v<fmtster::Base>);
+
+    // the serializer can be used directly with a format policy
+    using fmtster::internal::JSONFormat;
+    fmtster::internal::Serializer<JSONFormat> serializer(JSONFormat::Expansion::Get(fmtster::JSONStyle{}.value));
+    string str;
+    serializer.write(std::back_inserter(str), vector<string>{ "a\"b" }, 0, false);
+    EXPECT_EQ("[\n  \"a\\\"b\"\n]", str);
+}
+
+// original char-by-char JSON escaping, used as reference for the kernels
+string ReferenceJSONEscape(const string& strIn)
+{
+    string strOut;
+    for (const char c : strIn)
+    {
+        if ((c <= '\x1F') || (c >= '\x7F'))
+        {
+            switch (c)
+            {
+            case '\b': strOut += R"(\b)"; break;
+            case '\f': strOut += R"(\f)"; break;
+            case '\n': strOut += R"(\n)"; break;
+            case '\r': strOut += R"(\r)"; break;
+            case '\t': strOut += R"(\t)"; break;
+            default:
+                strOut += F(R"(\u{:04X})", (unsigned int)((unsigned char)c));
+            }
+        }
+        else
+        {
+            switch (c)
+            {
+            case '\\':   strOut += R"(\\)"; break;
+            case '\"':   strOut += R"(\")"; break;
+            case '/':    strOut += R"(\/)"; break;
+            case '\x7F': strOut += R"(\u007F)"; break;
+            default:     strOut += c;
+            }
+        }
+    }
+    return strOut;
+}
+
+TEST_F(FmtsterTest, EscapeKernels)
+{
+    using namespace fmtster::internal;
+
+    vector<pair<string, JSONEscapeScan> > kernels = { { "scalar", ScanJSONEscapeScalar } };
+#if FMTSTER_SIMD
+    kernels.emplace_back("SSE2", ScanJSONEscapeSSE2);
+    if (__builtin_cpu_supports("avx2"))
+        kernels.emplace_back("AVX2", ScanJSONEscapeAVX2);
+#endif // FMTSTER_SIMD
+
+    // every char value at each position of clean strings of lengths around
+    // the vector widths
+    vector<string> strs;
+    for (size_t len : { 1, 2, 15, 16, 17, 31, 32, 33, 47, 48, 63, 64, 65 })
+    {
+        for (size_t pos = 0; pos < len; pos++)
+        {
+            for (int c = 0; c < 256; c++)
+            {
+                string str(len, 'x');
+                str[pos] = (char)c;
+                strs.push_back(str);
+            }
+        }
+    }
+    strs.push_back("");
+    strs.push_back(string(1000, 'a') + "\"" + string(1000, '\xE4') + "\n");
+
+    for (const auto& [name, scan] : kernels)
+    {
+        for (const auto& str : strs)
+        {
+            string out;
+            JSONFormat::escape(std::back_inserter(out), str, scan);
+            ASSERT_EQ(ReferenceJSONEscape(str), out) << name;
+        }
+    }
+
+    // the UTF-8 mode kernels (which pass chars above ASCII) find the same
+    // runs as the scalar scan, also with multibyte sequences and runs of
+    // chars above ASCII straddling the vector widths
+    vector<pair<string, JSONEscapeScan> > utf8Kernels;
+#if FMTSTER_SIMD
+    utf8Kernels.emplace_back("UTF-8 SSE2", ScanUTF8JSONEscapeSSE2);
+    if (__builtin_cpu_supports("avx2"))
+        utf8Kernels.emplace_back("UTF-8 AVX2", ScanUTF8JSONEscapeAVX2);
+#endif // FMTSTER_SIMD
+
+    for (size_t pos : { 0, 1, 13, 14, 15, 16, 17, 29, 30, 31, 32, 33, 46, 47, 48, 62, 63, 64 })
+    {
+        for (const string seq : { "\xC3\xA9", "\xE4\xB8\xAD", "\xF0\x9F\x98\x80", "\xFF", "\x80\x80\x80" })
+        {
+            strs.push_back(string(pos, 'x') + seq);
+            strs.push_back(string(pos, 'x') + seq + string(40, 'y') + "\"" + seq);
+            strs.push_back(string(pos, '\xE4') + "\n" + string(pos, '\xB8'));
+        }
+    }
+
+    for (const auto& [name, scan] : utf8Kernels)
+    {
+        for (const auto& str : strs)
+        {
+            for (size_t start : { 0, 1, 3, 17, 33 })
+            {
+                if (start > str.size())
+                    break;
+                ASSERT_EQ(ScanUTF8JSONEscapeScalar(str.data() + start, str.size() - start),
+                          scan(str.data() + start, str.size() - start)) << name;
+            }
+            for (const bool replace : { false, true })
+            {
+                string expected;
+                JSONFormat::escapeUTF8(std::back_inserter(expected), str, replace, ScanUTF8JSONEscapeScalar);
+                string out;
+                JSONFormat::escapeUTF8(std::back_inserter(out), str, replace, scan);
+                ASSERT_EQ(expected, out) << name;
+            }
+        }
+    }
+}
+
+// output iterator which only counts the chars written to it
+struct CountingIterator
+{
+    size_t* pCount;
+
+    CountingIterator& operator*() { return *this; }
+    CountingIterator& operator++() { return *this; }
+    CountingIterator& operator++(int) { return *this; }
+    CountingIterator& operator=(char) { ++*pCount; return *this; }
+};
+
+TEST_F(FmtsterTest, EscapeWithoutTemporaries)
+{
+    // 1 MB of chars which each expand to 6 chars
+    const string str(1 << 20, '\x01');
+    size_t count = 0;
+    const size_t before = gAllocations;
+    fmtster::internal::JSONFormat::escape(CountingIterator{ &count }, str);
+    EXPECT_EQ(before, gAllocations);
+    EXPECT_EQ(6u << 20, count);
+}
+
+TEST_F(FmtsterTest, UTF8Validation)
+{
+    using namespace fmtster::internal;
+
+    vector<pair<string, UTF8Validate> > kernels = { { "scalar", ValidateUTF8Scalar } };
+#if FMTSTER_SIMD
+    if (__builtin_cpu_supports("avx2"))
+        kernels.emplace_back("AVX2", ValidateUTF8AVX2);
+#endif // FMTSTER_SIMD
+
+    // valid and invalid sequences, each placed at offsets around the vector
+    // width, and random mixtures of them
+    const vector<pair<string, bool> > seqs =
+    {
+        { "a", true }, { "\xC3\xA9", true }, { "\xE4\xB8\xAD", true },
+        { "\xF0\x9F\x98\x80", true }, { "\xF4\x8F\xBF\xBF", true },
+        { "\xED\x9F\xBF", true }, { "\xEF\xBF\xBD", true },
+        { "\x80", false }, { "\xBF", false }, { "\xC0\xAF", false },
+        { "\xC1\xBF", false }, { "\xC3", false }, { "\xE4\xB8", false },
+        { "\xE0\x9F\xBF", false }, { "\xED\xA0\x80", false },
+        { "\xF0\x8F\xBF\xBF", false }, { "\xF4\x90\x80\x80", false },
+        { "\xF5\x80\x80\x80", false }, { "\xFF", false },
+        { "\xF0\x9F\x98", false }, { "\xC3\xA9\xA9", false }
+    };
+
+    vector<pair<string, bool> > strs;
+    for (const auto& [seq, valid] : seqs)
+    {
+        for (size_t pos : { 0, 1, 13, 29, 30, 31, 32, 33, 62, 63, 64 })
+        {
+            strs.emplace_back(string(pos, 'x') + seq, valid);
+            strs.emplace_back(string(pos, 'x') + seq + "yz", valid);
+        }
+    }
+    srand(1);
+    for (int i = 0; i < 2000; i++)
+    {
+        string str;
+        bool valid = true;
+        for (int j = rand() % 40; j; j--)
+        {
+            const auto& seq = seqs[rand() % (((i % 3) == 0) ? seqs.size() : 7)];
+            str += seq.first;
+            valid = valid && seq.second;
+        }
+        strs.emplace_back(str, valid);
+    }
+
+    for (const auto& [name, validate] : kernels)
+    {
+        for (const auto& [str, valid] : strs)
+        {
+            // concatenating two invalid pieces can make a valid sequence
+            ASSERT_EQ(ValidateUTF8Scalar(str.data(), str.size()),
+                      validate(str.data(), str.size())) << name;
+            if (valid)
+            {
+                ASSERT_TRUE(validate(str.data(), str.size())) << name;
+            }
+        }
+    }
+}
+
+TEST_F(FmtsterTest, JSONStyle_UTF8)
+{
+    const vector<string> strs = { "中文 \"é\"", "bad\xC3 \xE4\xB8\xAD\xFF" };
+
+    fmtster::JSONStyle style;
+    EXPECT_EQ(R"([
+  "\u00E4\u00B8\u00AD\u00E6\u0096\u0087 \"\u00C3\u00A9\"",
+  "bad\u00C3 \u00E4\u00B8\u00AD\u00FF"
+])", F("{:,,{}}", strs, style.value));
+
+    // a long run directly after an escape follows it
+    const vector<string> longRun = { "\n" + string(200, 'a') };
+    EXPECT_EQ("[\n  \"\\n" + string(200, 'a') + "\"\n]", F("{}", longRun));
+
+    style.utf8 = fmtster::JSU::UTF8_REPLACE;
+    EXPECT_EQ("[\n  \"中文 \\\"é\\\"\",\n  \"bad\xEF\xBF\xBD 中\xEF\xBF\xBD\"\n]",
+              F("{:,,{}}", strs, style.value));
+
+    style.utf8 = fmtster::JSU::UTF8_ESCAPE;
+    EXPECT_EQ("[\n  \"中文 \\\"é\\\"\",\n  \"bad\\u00C3 中\\u00FF\"\n]",
+              F("{:,,{}}", strs, style.value));
+}
+
+TEST_F(FmtsterTest, JSONStyle_Gaps)
+{
+    const map<string, vector<int> > data = { { "a", { 1, 2 } }, { "b", { } }, { "c", { 3 } } };
+
+    EXPECT_EQ(R"({"a":[1,2],"b":[],"c":[3]})",
+              F("{:,,{}}", data, fmtster::PACKEDJSONCONFIG.value));
+
+    fmtster::JSONStyle style;
+    style.gapA = fmtster::JSS::SPACE;
+    style.gapB = fmtster::JSS::SPACE;
+    style.gapC = fmtster::JSS::SPACE;
+    style.gap2 = fmtster::JSS::BLANK;
+    style.gap5 = fmtster::JSS::BLANK;
+    style.singleLineArray = fmtster::JSS::PACKED;
+    EXPECT_EQ(R"({
+  "a": [ 1, 2 ],
+  "b": [ ],
+  "c": [3]
+})", F("{:,,{}}", data, style.value));
+
+    // the gaps of compile-time styles are constants, and match
+    constexpr auto SPACED = []()
+    {
+        auto fields = fmtster::GetJSONStyleFields(fmtster::DEFAULTJSONCONFIG);
+        fields.gapA = fmtster::JSS::SPACE;
+        fields.gapB = fmtster::JSS::SPACE;
+        fields.gapC = fmtster::JSS::SPACE;
+        fields.gap2 = fmtster::JSS::BLANK;
+        fields.gap5 = fmtster::JSS::BLANK;
+        fields.singleLineArray = fmtster::JSS::PACKED;
+        return fmtster::JSONStyleValue(fields);
+    }();
+    EXPECT_EQ(style.value, SPACED);
+    EXPECT_EQ(F("{:2,,{}}", data, style.value), fmtster::format<SPACED>(data, 2));
+
+    // single line objects
+    style = fmtster::JSONStyle();
+    style.singleLineObject = fmtster::JSS::SAMELINE;
+    const vector<map<string, int> > vmsi = { { { "x", 1 } }, { { "y", 2 }, { "z", 3 } } };
+    EXPECT_EQ(R"([
+  { "x" : 1 },
+  {
+    "y" : 2,
+    "z" : 3
+  }
+])", F("{:,,{}}", vmsi, style.value));
+
+    // newline gaps are indented to the depth of the brackets, also when they
+    // are disabled
+    style = fmtster::JSONStyle();
+    style.gapA = fmtster::JSS::NEWLINE_TABx2;
+    style.gapB = fmtster::JSS::NEWLINE_TABx2;
+    const vector<int> vi = { 1, 2 };
+    EXPECT_EQ("[\n    1,\n    2\n]", F("{:,,{}}", vi, style.value));
+    EXPECT_EQ("  1,\n  2", F("{:,-b,{}}", vi, style.value));
+    EXPECT_EQ("    1,\n    2", F("{:1,-b,{}}", vi, style.value));
+
+    // extra spaces after hard tabs
+    style = fmtster::JSONStyle();
+    style.hardTab = true;
+    style.tabCount = 1;
+    style.gapA = fmtster::JSS::NEWLINE_SPACEx2;
+    EXPECT_EQ("[\n\t  1,\n\t\t2\n\t]", F("{:1,,{}}", vi, style.value));
+
+    // deeper than the precomputed indents
+    EXPECT_EQ("[\n" + string(82, ' ') + "1,\n" + string(82, ' ') + "2\n" + string(80, ' ') + "]",
+              F("{:40}", vi));
+}
+
+TEST_F(FmtsterTest, StringLikeValuesAndKeys)
+{
+    const char text[] = "a\"b";
+    const std::string_view sv = "c/d";
+    const vector<const char*> ptrs = { "e\tf", text };
+    EXPECT_EQ(R"([
+  "e\tf",
+  "a\"b"
+])", F("{}", ptrs));
+
+    EXPECT_EQ(R"({
+  "c\/d" : "a\"b"
+})", F("{}", std::map<std::string_view, std::string_view>{ { sv, text } }));
+
+    EXPECT_EQ(R"({
+  "a\"b" : 1
+})", F("{}", std::make_pair(text, 1)));
+
+    const vector<const char*> nulls = { nullptr };
+    EXPECT_THROW(F("{}", nulls), fmt::format_error);
+
+    // no temporaries are built for string-like values or keys
+    const std::map<std::string_view, vector<std::string_view> > mvsv =
+    {
+        { "key\\1", { "a\nb", "c\"d" } },
+        { "key/2", { sv } }
+    };
+    EXPECT_EQ(0u, CountAllocations(mvsv));
+}
+
+TEST_F(FmtsterTest, MultimapValueOrder)
+{
+    // enough values per key to reverse forward-only ranges by halves
+    multimap<string, int> mm;
+    unordered_multimap<string, int> umm;
+    for (int i = 0; i < 40; i++)
+    {
+        mm.emplace("key", i);
+        umm.emplace("key", i);
+    }
+    mm.emplace("other", 0);
+
+    const auto expected = [](const auto& c, bool reverse)
+    {
+        // values in iteration order of the container, grouped by key
+        vector<pair<string, vector<int> > > groups;
+        for (const auto& [key, val] : c)
+        {
+            if (groups.empty() || (groups.back().first != key))
+                groups.emplace_back(key, vector<int>{});
+            auto& vals = groups.back().second;
+            if (reverse)
+                vals.insert(vals.begin(), val);
+            else
+                vals.push_back(val);
+        }
+        string str = "{";
+        for (size_t i = 0; i < groups.size(); i++)
+            str += F("{}\n  \"{}\" : {:1}", i ? "," : "", groups[i].first, groups[i].second);
+        return str + "\n}";
+    };
+
+    EXPECT_EQ(expected(mm, true), F("{}", mm));
+    EXPECT_EQ(expected(mm, false), F("{:,-r}", mm));
+    EXPECT_EQ(expected(umm, true), F("{}", umm));
+    EXPECT_EQ(expected(umm, false), F("{:,-r}", umm));
+
+    // the values are not copied into a temporary container
+    const string longStr = "a value too long for the small string optimization";
+    const multimap<string, string> mms = { { "key", longStr }, { "key", longStr } };
+    const unordered_multimap<string, string> umms(mms.begin(), mms.end());
+    EXPECT_EQ(0, CountAllocations(mms));
+    EXPECT_EQ(0, CountAllocations(mms, "{:,-r}"));
+    EXPECT_EQ(0, CountAllocations(umms));
+}
+
+TEST_F(FmtsterTest, CompiledFormat)
+{
+    const map<string, vector<int> > data = { { "a", { 1, 2 } }, { "b", { } } };
+
+    EXPECT_EQ(F("{}", data), fmtster::format(FMTSTER_COMPILE("{}"), data));
+    EXPECT_EQ(F("{:2,-b,,json}", data),
+              fmtster::format(FMTSTER_COMPILE("{:2,-b,,json}"), data));
+    EXPECT_EQ(F("data: {:1,,,0} end", data),
+              fmtster::format(FMTSTER_COMPILE("data: {:1,,,0} end"), data));
+
+    static_assert(fmtster::JSONStyleValue(fmtster::PACKEDJSONCONFIG) == 2);
+    EXPECT_EQ(F("{:,,{}}", data, fmtster::PACKEDJSONCONFIG.value),
+              fmtster::format(FMTSTER_COMPILE("{:,,2}"), data));
+
+    // parsed at compile time
+    constexpr auto spec = fmtster::internal::ParseCompiledSpec("x{:3,-b-r,17,j}y");
+    static_assert((spec.indent == 3) && spec.disableBras && !spec.reverseMultimaps &&
+                  (spec.style == 17) && (spec.format == 0) &&
+                  (spec.prefix == "x") && (spec.suffix == "y"));
+
+    // no allocations beyond the output
+    string str;
+    str.reserve(1000);
+    const size_t before = gAllocations;
+    fmtster::format_to(std::back_inserter(str), FMTSTER_COMPILE("{:1,-b}"), data);
+    EXPECT_EQ(before, gAllocations);
+
+#if defined(__cpp_nontype_template_args) && (__cpp_nontype_template_args >= 201911L)
+    // the C++20 spelling
+    EXPECT_EQ(fmtster::format(FMTSTER_COMPILE("{:2,-b,,json}"), data),
+              fmtster::format(fmtster::compiled<"{:2,-b,,json}">{}, data));
+    EXPECT_EQ(fmtster::format(FMTSTER_COMPILE("data: {:1,,2} end"), data),
+              fmtster::format(fmtster::compiled<"data: {:1,,2} end">{}, data));
+#endif // __cpp_nontype_template_args
+}
+
+TEST_F(FmtsterTest, StaticJSONStyle)
+{
+    const map<string, vector<int> > data = { { "a", { 1, 2 } }, { "b", { } } };
+
+    constexpr auto DEFAULT = fmtster::JSONStyleValue(fmtster::DEFAULTJSONCONFIG);
+    EXPECT_EQ(fmtster::JSONStyle{}.value, DEFAULT);
+    EXPECT_EQ(F("{}", data), fmtster::format<DEFAULT>(data));
+
+    constexpr auto HARDTAB = []()
+    {
+        auto fields = fmtster::GetJSONStyleFields(fmtster::DEFAULTJSONCONFIG);
+        fields.cr = true;
+        fields.hardTab = true;
+        fields.tabCount = 1;
+        return fmtster::JSONStyleValue(fields);
+    }();
+    fmtster::JSONStyle style;
+    style.cr = true;
+    style.hardTab = true;
+    style.tabCount = 1;
+    EXPECT_EQ(style.value, HARDTAB);
+    EXPECT_EQ(F("{:2,,{}}", data, style.value), fmtster::format<HARDTAB>(data, 2));
+
+    // the expansions are constants
+    using Expansion = fmtster::internal::StaticJSONStyleExpansion<HARDTAB>;
+    static_assert(Expansion::mNewline == "\r\n");
+    static_assert(Expansion::indent(3) == "\t\t\t");
+
+    // compiled format strings with a literal style use them too
+    EXPECT_EQ(F("{:1,,{}}", data, style.value),
+              fmtster::format(FMTSTER_COMPILE("{:1,,1128190060811901967}"), data));
+    static_assert(HARDTAB == 1128190060811901967u);
+}
+
+TEST_F(FmtsterTest, SerializedSize)
+{
+    const map<string, vector<string> > data =
+    {
+        { "a\"1", { "x\ny", "中文" } }, { "b", { } }, { "c", { string(300, '\x01') } }
+    };
+    const std::multimap<string, int> mm = { { "k", 1 }, { "k", 2 }, { "l", 3 } };
+
+    fmtster::JSONStyle style;
+    style.hardTab = true;
+    style.tabCount = 1;
+    style.utf8 = fmtster::JSU::UTF8_REPLACE;
+    for (const auto value : { fmtster::JSONStyle().value,
+                              fmtster::PACKEDJSONCONFIG.value,
+                              style.value })
+    {
+        EXPECT_EQ(F("{:,,{}}", data, value).size(), fmtster::serialized_size(data, value));
+        EXPECT_EQ(F("{:,,{}}", mm, value).size(), fmtster::serialized_size(mm, value));
+        EXPECT_EQ(F("{:3,,{}}", data, value).size(), fmtster::serialized_size(data, value, 3));
+        EXPECT_EQ(F("{:3,,{}}", data, value), fmtster::format_exact(data, value, 3));
+    }
+    EXPECT_EQ(F("{}", 1.5), fmtster::format_exact(1.5));
+    EXPECT_EQ(F("{}", data).size(), fmtster::serialized_size(data));
+
+    // the string is allocated once, at its final size
+    const size_t before = gAllocations;
+    const auto str = fmtster::format_exact(data);
+    EXPECT_EQ(before + 1, gAllocations);
+    EXPECT_EQ(str.size(), str.capacity());
+}
+
+TEST_F(FmtsterTest, Sinks)
+{
+    const map<string, vector<int> > data = { { "a", { 1, 2, 3 } }, { "b\"", { } } };
+    const string ref = F("{}", data);
+
+    // the buffer is passed on each time it fills
+    vector<string> chunks;
+    {
+        auto writer = [&chunks](const char* p, size_t size) { chunks.emplace_back(p, size); };
+        fmtster::BufferedSink<decltype(writer), 8> sink(writer);
+        fmtster::print(sink, data);
+        fmt::format_to(sink.out(), " {}", vector<int>{ 4 });
+    }
+    string joined;
+    for (const auto& chunk : chunks)
+    {
+        EXPECT_GE(8u, chunk.size());
+        joined += chunk;
+    }
+    EXPECT_EQ(ref + " " + F("{}", vector<int>{ 4 }), joined);
+
+    // strings longer than the buffer are written directly
+    chunks.clear();
+    {
+        auto writer = [&chunks](const char* p, size_t size) { chunks.emplace_back(p, size); };
+        fmtster::BufferedSink<decltype(writer), 8> sink(writer);
+        fmtster::print(sink, map<string, int>{ { string(20, 'k'), 1 } }, fmtster::PACKEDJSONCONFIG.value);
+    }
+    EXPECT_EQ(vector<string>({ "{\"", string(20, 'k'), "\":1}" }), chunks);
+
+    // memory does not depend on the size of the output
+    const vector<int> big(100000, 12345);
+    size_t total = 0;
+    auto counter = [&total](const char*, size_t size) { total += size; };
+    fmtster::BufferedSink<decltype(counter)> sink(counter);
+    fmtster::print(sink, big);
+    const size_t before = gAllocations;
+    fmtster::print(sink, big);
+    sink.flush();
+    EXPECT_EQ(before, gAllocations);
+    EXPECT_EQ(2 * F("{}", big).size(), total);
+
+    // FILE*, file descriptor and std::ostream
+    std::FILE* pFile = std::tmpfile();
+    ASSERT_NE(nullptr, pFile);
+    fmtster::print(pFile, data);
+    std::fflush(pFile);
+    fmtster::print(fileno(pFile), data, fmtster::JSONStyle(), 1);
+    std::rewind(pFile);
+    string contents(4096, '\0');
+    contents.resize(std::fread(contents.data(), 1, contents.size(), pFile));
+    std::fclose(pFile);
+    EXPECT_EQ(ref + F("{:1}", data), contents);
+
+    std::ostringstream oss;
+    fmtster::print(oss, data, fmtster::PACKEDJSONCONFIG.value);
+    EXPECT_EQ(F("{:,,{}}", data, fmtster::PACKEDJSONCONFIG.value), oss.str());
+}
+
+TEST_F(FmtsterTest, FormatToN)
+{
+    // a 1M element vector stops being traversed once the budget is reached
+    const vector<int> big(1000000, 12345);
+    string str;
+    auto result = fmtster::format_to_n(std::back_inserter(str), 4100, "{}", big);
+    EXPECT_TRUE(result.truncated);
+    EXPECT_EQ(4100u, result.size);
+    EXPECT_EQ(F("{}", vector<int>(500, 12345)).substr(0, 4100), str);
+    EXPECT_EQ(1000000u - 456, result.omitted);
+
+    // closed, the last complete element which leaves room for the bracket
+    str.clear();
+    result = fmtster::format_to_n(std::back_inserter(str), 4100, "{}", big, true);
+    EXPECT_TRUE(result.truncated);
+    EXPECT_EQ(F("{}", vector<int>(455, 12345)), str);
+
+    // every budget gives a prefix of the output, or valid JSON when closed
+    const map<string, vector<int> > nested = { { "a", { 1, 2 } }, { "b", { } }, { "c", { 3, 4, 5 } } };
+    const multimap<string, tuple<pair<string, int> > > mm =
+        { { "x", { { "i", 1 } } }, { "x", { { "i", 2 } } }, { "y", { { "i", 3 } } } };
+    const auto check = [](const auto& data, const char* fmtStr)
+    {
+        const string full = F(fmtStr, data);
+        for (size_t n = 0; n <= full.size() + 1; n++)
+        {
+            string raw;
+            const auto rawResult = fmtster::format_to_n(std::back_inserter(raw), n, fmtStr, data);
+            EXPECT_EQ(full.substr(0, n), raw);
+            EXPECT_EQ(n < full.size(), rawResult.truncated);
+
+            string closed;
+            const auto closedResult = fmtster::format_to_n(std::back_inserter(closed), n, fmtStr, data, true);
+            EXPECT_GE(n, closed.size());
+            EXPECT_EQ(closed.size(), closedResult.size);
+            EXPECT_EQ(n < full.size(), closedResult.truncated) << n;
+            if (!closedResult.truncated)
+            {
+                EXPECT_EQ(full, closed);
+                continue;
+            }
+            string packed;
+            for (const char c : closed)
+            {
+                if ((c != ' ') && (c != '\n'))
+                    packed += c;
+            }
+            EXPECT_EQ(std::count(packed.begin(), packed.end(), '['),
+                      std::count(packed.begin(), packed.end(), ']')) << closed;
+            EXPECT_EQ(std::count(packed.begin(), packed.end(), '{'),
+                      std::count(packed.begin(), packed.end(), '}')) << closed;
+            EXPECT_EQ(string::npos, packed.find(",]")) << closed;
+            EXPECT_EQ(string::npos, packed.find(",}")) << closed;
+            EXPECT_EQ(string::npos, packed.find(":}")) << closed;
+        }
+    };
+    check(nested, "{}");
+    check(nested, "{:1,,2}");
+    check(mm, "{}");
+    check(mm, "{:,-r}");
+    check(vector<vector<int> >{ { } }, "{}");
+    check(vector<vector<int> >{ { 1 }, { } }, "{}");
+    check(map<string, vector<int> >{ { "a", { } } }, "{}");
+    check(make_tuple(make_pair("a", vector<int>{ 1 }), make_tuple()), "{}");
+    fmtster::JSONStyle sameLine;
+    sameLine.singleLineArray = fmtster::JSS::SAMELINE;
+    check(map<string, vector<int> >{ { "a", { 1 } }, { "b", { } } }, F("{{:,,{}}}", sameLine.value).c_str());
+
+    string closed;
+    result = fmtster::format_to_n(std::back_inserter(closed), 40, "{}", nested, true);
+    EXPECT_EQ("{\n  \"a\" : [\n    1,\n    2\n  ]\n}", closed);
+    EXPECT_EQ(1u, result.omitted);
+
+    // long strings are cut short
+    fmtster::JSONStyle style;
+    style.utf8 = fmtster::JSU::UTF8_REPLACE;
+    const vector<string> strs = { string(100000, 'a') + "中文", "b" };
+    str.clear();
+    fmtster::format_to_n(std::back_inserter(str), 100, F("{{:,,{}}}", style.value), strs);
+    EXPECT_EQ(F("{:,,{}}", strs, style.value).substr(0, 100), str);
+
+    // literal text around the field, and compiled format strings
+    str.clear();
+    result = fmtster::format_to_n(std::back_inserter(str), 100, FMTSTER_COMPILE("x{:,,2}y"), nested);
+    EXPECT_FALSE(result.truncated);
+    EXPECT_EQ(R"(x{"a":[1,2],"b":[],"c":[3,4,5]}y)", str);
+
+    // a budget far beyond the output is not reserved up front
+    for (const bool close : { false, true })
+    {
+        str.clear();
+        result = fmtster::format_to_n(std::back_inserter(str), SIZE_MAX, "{}", vector<int>{ 1 }, close);
+        EXPECT_FALSE(result.truncated);
+        EXPECT_EQ("[\n  1\n]", str);
+        str.clear();
+        result = fmtster::format_to_n(std::back_inserter(str), size_t(1) << 40, "{}", big, close);
+        EXPECT_FALSE(result.truncated);
+        EXPECT_EQ(F("{}", big), str);
+    }
+}
+
+TEST_F(FmtsterTest, Elision)
+{
+    vector<int> v(1000000);
+    for (size_t i = 0; i < v.size(); i++)
+        v[i] = int(i);
+    EXPECT_EQ(R"([0,1,"... 999996 more",999998,999999])", F("{:,e2,2}", v));
+    EXPECT_EQ(R"([0,1,2,3])", F("{:,e2,2}", vector<int>{ 0, 1, 2, 3 }));
+    EXPECT_EQ(R"([1,2,3])", F("{:,e1-e,2}", vector<int>{ 1, 2, 3 }));
+    EXPECT_EQ("[\n  1,\n  \"... 1 more\",\n  3\n]", F("{:,e1}", vector<int>{ 1, 2, 3 }));
+
+    // forward-only containers
+    const forward_list<int> fl = { 1, 2, 3, 4, 5, 6 };
+    EXPECT_EQ(R"([1,2,"... 2 more",5,6])", F("{:,e2,2}", fl));
+
+    // objects get a member with a null value
+    const map<string, int> m = { { "a", 1 }, { "b", 2 }, { "c", 3 }, { "d", 4 } };
+    EXPECT_EQ(R"({"a":1,"... 2 more":null,"d":4})", F("{:,e1,2}", m));
+    EXPECT_EQ("{\n  \"a\" : 1,\n  \"... 2 more\" : null,\n  \"d\" : 4\n}", F("{:,e1}", m));
+
+    // nested containers are elided too
+    const vector<vector<int> > vv(3, { 0, 1, 2, 3, 4 });
+    EXPECT_EQ(R"([[0,"... 3 more",4],"... 1 more",[0,"... 3 more",4]])", F("{:,e1,2}", vv));
+
+    // multimaps elide keys (counting their elements) and the values of a key
+    const multimap<string, int> mmKeys =
+        { { "a", 1 }, { "b", 1 }, { "b", 2 }, { "b", 3 }, { "c", 1 }, { "d", 1 } };
+    EXPECT_EQ(R"({"a":[1],"... 4 more":null,"d":[1]})", F("{:,e1,2}", mmKeys));
+    const multimap<string, int> mmValues =
+        { { "x", 1 }, { "x", 2 }, { "x", 3 }, { "x", 4 }, { "x", 5 } };
+    EXPECT_EQ(R"({"x":[5,4,"... 1 more",2,1]})", F("{:,e2,2}", mmValues));
+    EXPECT_EQ(R"({"x":[1,2,"... 1 more",4,5]})", F("{:,e2-r,2}", mmValues));
+
+    const unordered_multimap<string, int> umm(mmValues.begin(), mmValues.end());
+    vector<int> order;
+    for (const auto& entry : umm)
+        order.push_back(entry.second);
+    EXPECT_EQ(F(R"({{"x":[{},{},"... 1 more",{},{}]}})", order[4], order[3], order[1], order[0]),
+              F("{:,e2,2}", umm));
+    EXPECT_EQ(F(R"({{"x":[{},{},"... 1 more",{},{}]}})", order[0], order[1], order[3], order[4]),
+              F("{:,e2-r,2}", umm));
+
+    // compiled format strings and byte-budgeted output
+    string str;
+    fmtster::format_to(std::back_inserter(str), FMTSTER_COMPILE("{:,e2,2}"), v);
+    EXPECT_EQ(F("{:,e2,2}", v), str);
+    str.clear();
+    const auto result = fmtster::format_to_n(std::back_inserter(str), 100, "{:,e2,2}", v);
+    EXPECT_FALSE(result.truncated);
+    EXPECT_EQ(F("{:,e2,2}", v), str);
+    str.clear();
+    fmtster::format_to_n(std::back_inserter(str), 10, "{:,e2,2}", v);
+    EXPECT_EQ(F("{:,e2,2}", v).substr(0, 10), str);
+
+    // the count is required (unless negated), and must fit in a size_t
+    EXPECT_THROW(F("{:,e,2}", v), fmt::format_error);
+    EXPECT_THROW(F("{:,e-b,2}", v), fmt::format_error);
+    EXPECT_EQ(F("{:,,2}", v), F("{:,e2-e,2}", v));
+    EXPECT_EQ(F("{:,,2}", v), F("{:,e0,2}", v));
+    EXPECT_EQ(F("{:,,2}", v), F("{:,e18446744073709551615,2}", v));
+    EXPECT_THROW(F("{:,e18446744073709551616,2}", v), fmt::format_error);
+    EXPECT_THROW(F("{:,e99999999999999999999999,2}", v), fmt::format_error);
+    EXPECT_THROW(F("{:,p99999999999999999999999,2}", v), fmt::format_error);
+}
+
+TEST_F(FmtsterTest, MappedFileSink)
+{
+    unordered_map<string, unordered_map<string, vector<int> > > data;
+    for (int i = 0; i < 200; i++)
+        data[F("outer{}", i)] = { { "inner", vector<int>(50, i) }, { "empty", { } } };
+    const string ref = F("{}", data);
+    const string path = testing::TempDir() + "fmtster_mapped_file_sink.json";
+
+    const auto contents = [&path]()
+    {
+        std::FILE* pFile = std::fopen(path.c_str(), "rb");
+        EXPECT_NE(nullptr, pFile);
+        string str;
+        char buffer[4096];
+        for (size_t n; (n = std::fread(buffer, 1, sizeof(buffer), pFile)) > 0; )
+            str.append(buffer, n);
+        std::fclose(pFile);
+        return str;
+    };
+
+    // the smallest step grows the mapping (and file) many times, and the file
+    // is trimmed to the output
+    {
+        fmtster::MappedFileSink sink(path, 1, true);
+        fmtster::print(sink, data);
+        fmt::format_to(sink.out(), " {}", string(10000, 'x'));
+        EXPECT_EQ(ref.size() + 10001, sink.size());
+    }
+    EXPECT_EQ(ref + " " + string(10000, 'x'), contents());
+
+    // an existing file is truncated, and errors are seen by close()
+    {
+        fmtster::MappedFileSink sink(path);
+        fmtster::print(sink, vector<int>{ 1 }, fmtster::PACKEDJSONCONFIG.value);
+        sink.close();
+        sink.close();
+
+        // and it is not written after being closed
+        EXPECT_THROW(sink.push_back('x'), std::system_error);
+        EXPECT_THROW(sink.append("xy", 2), std::system_error);
+        EXPECT_THROW(fmtster::print(sink, vector<int>{ 2 }), std::system_error);
+    }
+    EXPECT_EQ("[1]", contents());
+
+    // nothing written leaves an empty file
+    {
+        fmtster::MappedFileSink sink(path);
+    }
+    EXPECT_EQ("", contents());
+
+    std::remove(path.c_str());
+    EXPECT_THROW(fmtster::MappedFileSink(testing::TempDir() + "no/such/dir/file"), std::system_error);
+}
+
+TEST_F(FmtsterTest, GatherSink)
+{
+    const string longStr(1000, 'a');
+    const string escapedStr = "\"" + string(200, 'b') + "\n" + string(100, 'c');
+    const map<string, vector<string> > data =
+        { { string(300, 'k'), { longStr, "short", escapedStr } }, { "empty", { } } };
+    const string ref = F("{}", data);
+
+    fmtster::GatherSink sink;
+    fmtster::print(sink, data);
+    EXPECT_EQ(ref, sink.str());
+    EXPECT_EQ(ref.size(), sink.size());
+
+    // the long clean runs of the key and values are referenced in place
+    const auto iov = sink.iovecs();
+    const auto referenced = [&iov](const char* p, size_t size)
+    {
+        return std::any_of(iov.begin(), iov.end(), [p, size](const iovec& v)
+                           {
+                               return (v.iov_base == p) && (v.iov_len == size);
+                           });
+    };
+    EXPECT_TRUE(referenced(data.rbegin()->first.data(), 300));
+    EXPECT_TRUE(referenced(data.rbegin()->second[0].data(), 1000));
+    EXPECT_TRUE(referenced(data.rbegin()->second[2].data() + 1, 200));
+    EXPECT_EQ(ref.size() - 1500, sink.copied());
+
+    // written to an fd with writev()
+    std::FILE* pFile = std::tmpfile();
+    ASSERT_NE(nullptr, pFile);
+    sink.write(fileno(pFile));
+    std::rewind(pFile);
+    string contents(ref.size() + 1, '\0');
+    contents.resize(std::fread(contents.data(), 1, contents.size(), pFile));
+    std::fclose(pFile);
+    EXPECT_EQ(ref, contents);
+
+    // also with {fmt} through the output iterator, after clearing
+    sink.clear();
+    fmt::format_to(sink.out(), "x{}y", longStr);
+    EXPECT_EQ("x" + longStr + "y", sink.str());
+    EXPECT_EQ(longStr.size() + 2, sink.copied());
+}
+
+TEST_F(FmtsterTest, ParallelSerialization)
+{
+    // (the containers are above the size at which they are split)
+    vector<int> v(100000);
+    for (size_t i = 0; i < v.size(); i++)
+        v[i] = int(i);
+    EXPECT_EQ(F("{}", v), F("{:,p4}", v));
+    EXPECT_EQ(F("{}", v), F("{:,p}", v));
+    EXPECT_EQ(F("{:2,-b,2}", v), F("{:2,-bp3,2}", v));
+    EXPECT_EQ(F("{}", v), F("{:,p4-p}", v));
+
+    map<string, vector<int> > m;
+    unordered_map<string, int> um;
+    set<string> s;
+    for (int i = 0; i < 20000; i++)
+    {
+        m[F("key{}", i)] = { i, -i };
+        um[F("key{}", i)] = i;
+        s.insert(F("{}\n", i));
+    }
+    EXPECT_EQ(F("{}", m), F("{:,p5}", m));
+    EXPECT_EQ(F("{:1,,2}", um), F("{:1,p7,2}", um));
+    EXPECT_EQ(F("{}", s), F("{:,p2}", s));
+    const forward_list<int> fl(v.begin(), v.end());
+    EXPECT_EQ(F("{}", fl), F("{:,p3}", fl));
+
+    // nested containers are split when their parent is small
+    const vector<vector<int> > nested = { v, { }, v };
+    EXPECT_EQ(F("{}", nested), F("{:,p4}", nested));
+
+    // compiled format strings
+    EXPECT_EQ(F("{}", m), fmtster::format(FMTSTER_COMPILE("{:,p4}"), m));
+
+    // errors in any chunk are thrown by the caller
+    vector<const char*> strs(50000, "x");
+    strs[40000] = nullptr;
+    EXPECT_THROW(F("{:,p4}", strs), fmt::format_error);
+}
+
+TEST_F(FmtsterTest, ThreadSafeDefaults)
+{
+    const vector<int> v = { 1, 2 };
+    const auto packed = fmtster::PACKEDJSONCONFIG.value;
+    const string defaultStr = F("{}", v);
+    const string packedStr = F("{:,,{}}", v, packed);
+
+    // a scoped style applies only to its own thread, and can be nested
+    {
+        fmtster::ScopedStyle scoped(packed);
+        EXPECT_EQ(packedStr, F("{}", v));
+        EXPECT_EQ(packed, fmtster::Base::GetDefaultJSONStyle().value);
+        {
+            fmtster::ScopedStyle inner(fmtster::JSONStyle{});
+            EXPECT_EQ(defaultStr, F("{}", v));
+        }
+        EXPECT_EQ(packedStr, fmtster::format(FMTSTER_COMPILE("{}"), v));
+
+        string other;
+        std::thread([&other, &v]() { other = F("{}", v); }).join();
+        EXPECT_EQ(defaultStr, other);
+    }
+    EXPECT_EQ(defaultStr, F("{}", v));
+
+    // the default changed by some threads while others serialize
+    std::atomic<size_t> mismatches(0);
+    vector<std::thread> threads;
+    for (int t = 0; t < 2; t++)
+    {
+        threads.emplace_back([t, &packed]()
+                             {
+                                 for (int i = 0; i < 2000; i++)
+                                     F("{:,s,{}}", make_tuple(), ((i + t) % 2) ? packed : fmtster::JSONStyle{}.value);
+                             });
+    }
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back([&, t]()
+                             {
+                                 const bool isScoped = t % 2;
+                                 std::optional<fmtster::ScopedStyle> scoped;
+                                 if (isScoped)
+                                     scoped.emplace(packed);
+                                 for (int i = 0; i < 2000; i++)
+                                 {
+                                     const auto str = F("{}", v);
+                                     if ((str != packedStr) && (isScoped || (str != defaultStr)))
+                                         mismatches++;
+                                 }
+                             });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    EXPECT_EQ(0u, mismatches);
+
+    // (restored for the following tests)
+    F("{:,s,{}}", make_tuple(), fmtster::JSONStyle{}.value);
+    EXPECT_EQ(fmtster::JSONStyle{}.value, fmtster::Base::GetDefaultJSONStyle().value);
+}
+
+TEST_F(FmtsterTest, MemoryResource)
+{
+    const map<string, vector<string> > data =
+        { { "a", { string(100, 'x'), "y\n" } }, { string(50, 'k'), { } } };
+
+    // (the arena cannot fall back on the heap)
+    char buffer[16 * 1024];
+    std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer), std::pmr::null_memory_resource());
+
+    // the first use of a style expands it on the heap, once
+    fmtster::JSONStyle fresh;
+    fresh.gap1 = 13;
+    fresh.gap4 = 11;
+    size_t before = gAllocations;
+    const auto first = fmtster::format_exact(&arena, data, fresh.value);
+    EXPECT_LT(before, gAllocations);
+    before = gAllocations;
+    const auto second = fmtster::format_exact(&arena, data, fresh.value);
+    EXPECT_EQ(before, gAllocations);
+    EXPECT_EQ(first, second);
+    EXPECT_EQ(F("{:,,{}}", data, fresh.value), std::string_view(first));
+
+    // after which nothing is allocated from the heap (with these styles
+    // expanded by the expected output)
+    const string expected = F("x{:1,-b}y", data);
+    const string expectedPacked = F("{:,,2}", data);
+    before = gAllocations;
+    const auto str = fmtster::format(&arena, "x{:1,-b}y", data);
+    const auto compiled = fmtster::format(&arena, FMTSTER_COMPILE("{:,,2}"), data);
+    const auto exact = fmtster::format_exact(&arena, data, fmtster::PACKEDJSONCONFIG.value);
+    EXPECT_EQ(before, gAllocations);
+
+    EXPECT_EQ(expected, std::string_view(str));
+    EXPECT_EQ(expectedPacked, std::string_view(compiled));
+    EXPECT_EQ(compiled, exact);
+    EXPECT_EQ(&arena, str.get_allocator().resource());
+    EXPECT_EQ(&arena, exact.get_allocator().resource());
+}
+
+// (scalar whose formatting is counted, to see what was serialized again)
+struct Counted
+{
+    int mValue;
+};
+size_t gCountedFormats = 0;
+
+template<>
+struct fmt::formatter<Counted>
+  : fmt::formatter<int>
+{
+    template<typename FormatContext>
+    auto format(const Counted& c, FormatContext& ctx) const
+    {
+        gCountedFormats++;
+        return fmt::formatter<int>::format(c.mValue, ctx);
+    }
+};
+
+TEST_F(FmtsterTest, CachedSubtrees)
+{
+    using Leaf = fmtster::Cached<vector<Counted> >;
+    map<string, fmtster::Cached<map<string, Leaf> > > state;
+    map<string, map<string, vector<int> > > plain;
+    for (const string outer : { "a", "b", "c" })
+    {
+        for (const string inner : { "x", "y", "z" })
+        {
+            state[outer].modify()[inner] = Leaf({ { 1 }, { 2 } });
+            plain[outer][inner] = { 1, 2 };
+        }
+    }
+
+    gCountedFormats = 0;
+    EXPECT_EQ(F("{}", plain), F("{}", state));
+    EXPECT_EQ(18u, gCountedFormats);
+
+    // unchanged subtrees are copied from their cache
+    gCountedFormats = 0;
+    EXPECT_EQ(F("{}", plain), F("{}", state));
+    EXPECT_EQ(0u, gCountedFormats);
+
+    // changes made through modify() serialize only their own path again
+    state["a"].modify()["x"].modify().push_back({ 3 });
+    plain["a"]["x"].push_back(3);
+    gCountedFormats = 0;
+    EXPECT_EQ(F("{}", plain), F("{}", state));
+    EXPECT_EQ(3u, gCountedFormats);
+
+    state["b"].modify()["y"].set({ { 4 } });
+    plain["b"]["y"] = { 4 };
+    gCountedFormats = 0;
+    EXPECT_EQ(F("{}", plain), F("{}", state));
+    EXPECT_EQ(1u, gCountedFormats);
+
+    // other indents, styles and per call parms are serialized again, at their
+    // own depth
+    EXPECT_EQ(F("{:2}", plain), F("{:2}", state));
+    EXPECT_EQ(F("{:,,2}", plain), F("{:,,2}", state));
+    EXPECT_EQ(F("{:1,-b}", plain), F("{:1,-b}", state));
+    EXPECT_EQ(F("{:,e1}", plain), F("{:,e1}", state));
+    EXPECT_EQ(F("{}", plain["c"]), F("{}", state["c"]));
+    const Leaf& leaf = state["c"]->at("z");
+    EXPECT_EQ(F("{}", vector<vector<int> >{ plain["c"]["z"] }), F("{}", vector<Leaf>{ leaf }));
+    EXPECT_EQ(F("{}", plain), F("{}", state));
+
+    // single-line styles see through the cache
+    fmtster::JSONStyle style;
+    style.singleLineArray = fmtster::JSS::SAMELINE;
+    const vector<fmtster::Cached<int> > ints = { 5 };
+    EXPECT_EQ(F("{:,,{}}", vector<int>{ 5 }, style.value), F("{:,,{}}", ints, style.value));
+
+    // budgeted and counted output
+    string str;
+    fmtster::format_to_n(std::back_inserter(str), 20, "{}", state);
+    EXPECT_EQ(F("{}", plain).substr(0, 20), str);
+    EXPECT_EQ(F("{}", plain).size(), fmtster::serialized_size(state));
+}
+
+TEST_F(FmtsterTest, KeyCache)
+{
+    vector<map<string, int> > records(1000);
+    for (size_t i = 0; i < records.size(); i++)
+        records[i] = { { "id", int(i) }, { "na\"me", 1 }, { "中文", 2 }, { string(100, 'k'), 3 } };
+
+    EXPECT_EQ(F("{}", records), F("{:,k}", records));
+    EXPECT_EQ(F("{:1,-b,2}", records), F("{:1,-bk,2}", records));
+    EXPECT_EQ(F("{:,,2}", records), fmtster::format(FMTSTER_COMPILE("{:,k,2}"), records));
+
+    // every separator gap (the cache is emptied by each change of style)
+    fmtster::JSONStyle style;
+    style.utf8 = fmtster::JSU::UTF8_REPLACE;
+    for (unsigned gap = 0; gap < 16; gap++)
+    {
+        style.gap5 = gap;
+        style.gap6 = 15 - gap;
+        ASSERT_EQ(F("{:,,{}}", records, style.value), F("{:,k,{}}", records, style.value)) << gap;
+    }
+
+    // each thread has its own cache
+    vector<map<string, int> > many(50000, records[0]);
+    EXPECT_EQ(F("{}", many), F("{:,kp4}", many));
+
+    // keys are written from the cache without allocating
+    const vector<map<string, int> > some(records.begin(), records.begin() + 100);
+    F("{:,k}", some);
+    EXPECT_EQ(0u, CountAllocations(some, "{:,k}"));
+
+    // the table is bounded, and long keys are not cached
+    fmtster::KeyCache cache(3, 8);
+    const auto& expansion = fmtster::internal::JSONStyleExpansion::Get(fmtster::JSONStyle{}.value);
+    for (int i = 0; i < 100; i++)
+    {
+        const auto key = F("k{}", i);
+        const auto pEntry = cache.get(key, expansion);
+        ASSERT_NE(nullptr, pEntry);
+        EXPECT_EQ("\"" + key + "\"", pEntry->quoted());
+    }
+    EXPECT_EQ(nullptr, cache.get("123456789", expansion));
+}
+
+TEST_F(FmtsterTest, ColumnarRecords)
+{
+    using Record = tuple<pair<string, int>, pair<const char*, string> >;
+    const vector<Record> records = { { { "id", 1 }, { "name", "a" } },
+                                     { { "id", 2 }, { "name", "b" } },
+                                     { { "id", 3 }, { "name", "c" } } };
+
+    EXPECT_EQ(R"({"id":[1,2,3],"name":["a","b","c"]})", F("{:,c,2}", records));
+    EXPECT_EQ(R"({"keys":["id","name"],"rows":[[1,"a"],[2,"b"],[3,"c"]]})", F("{:,t,2}", records));
+    EXPECT_EQ(F("{:,,2}", records), F("{:,c-c,2}", records));
+    EXPECT_EQ(F("{:,t,2}", records), F("{:,ct,2}", records));
+    EXPECT_EQ("{\n"
+              "  \"id\" : [\n"
+              "    1,\n"
+              "    2,\n"
+              "    3\n"
+              "  ],\n"
+              "  \"name\" : [\n"
+              "    \"a\",\n"
+              "    \"b\",\n"
+              "    \"c\"\n"
+              "  ]\n"
+              "}",
+              F("{:,c}", records));
+    EXPECT_EQ(F("{:,c,2}", records), fmtster::format(FMTSTER_COMPILE("{:,c,2}"), records));
+    EXPECT_EQ(F("{:1,-bt}", records), fmtster::format(FMTSTER_COMPILE("{:1,-bt}"), records));
+
+    // containers without size(), and nested containers of records
+    const list<Record> recordList(records.begin(), records.end());
+    EXPECT_EQ(F("{:,t,2}", records), F("{:,t,2}", recordList));
+    const map<string, vector<Record> > nested = { { "x", records } };
+    EXPECT_EQ(R"({"x":{"id":[1,2,3],"name":["a","b","c"]}})", F("{:,c,2}", nested));
+
+    // cached records are serialized again for another layout
+    const fmtster::Cached<vector<Record> > cached = records;
+    EXPECT_EQ(F("{:,,2}", records), F("{:,,2}", cached));
+    EXPECT_EQ(F("{:,c,2}", records), F("{:,c,2}", cached));
+    EXPECT_EQ(F("{:,t,2}", records), F("{:,t,2}", cached));
+    EXPECT_EQ(F("{:,c,2}", nested), F("{:,c,2}", map<string, fmtster::Cached<vector<Record> > >{ { "x", records } }));
+
+    // empty containers and differing keys are written as usual
+    EXPECT_EQ("[]", F("{:,c,2}", vector<Record>{}));
+    vector<Record> mixed = records;
+    std::get<0>(mixed[2]).first = "ix";
+    EXPECT_EQ(F("{:,,2}", mixed), F("{:,c,2}", mixed));
+    EXPECT_EQ(F("{:,,2}", mixed), F("{:,t,2}", mixed));
+
+    // combined with other per call parms
+    EXPECT_EQ(R"({"id":[1,"... 1 more",3],"name":["a","... 1 more","c"]})", F("{:,ce1,2}", records));
+    const vector<Record> many(20000, records[0]);
+    EXPECT_EQ(F("{:,t,2}", many), F("{:,tp4k,2}", many));
+    string str;
+    fmtster::format_to_n(std::back_inserter(str), 10, "{:,c,2}", records);
+    EXPECT_EQ(F("{:,c,2}", records).substr(0, 10), str);
+}